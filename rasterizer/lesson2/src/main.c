@@ -13,10 +13,50 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// The Windows headers give us these, but nobody else does
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/** Rasterization strategies. */
+typedef enum {
+  /** Walk every pixel in each triangle's bounding box. */
+  RASTER_SCAN,
+
+  /** Bin triangles into screen tiles and accept or reject whole blocks of pixels. */
+  RASTER_TILED,
+} raster_mode_t;
+
+/** Renderer options. */
+static struct {
+  raster_mode_t raster;
+} options = {
+  .raster = RASTER_SCAN,
+};
+
+/** Parse command line arguments into the options. */
+static int parse_options(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--raster=scan")) {
+      options.raster = RASTER_SCAN;
+    } else if (!strcmp(argv[i], "--raster=tiled")) {
+      options.raster = RASTER_TILED;
+    } else {
+      fprintf(stderr, "error: unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 /** An RGBA color. */
 typedef struct {
   uint8_t r;
@@ -125,7 +165,219 @@ static void triangle(image_t* image, vec2_t a, vec2_t b, vec2_t c, color_t color
   }
 }
 
-int main(void) {
+/** A function linear over the screen. */
+typedef struct {
+  float dx;
+  float dy;
+  float c;
+} plane_t;
+
+/** Evaluate a plane at a point. */
+inline static float plane_at(plane_t p, float x, float y) {
+  return p.c + p.dx * x + p.dy * y;
+}
+
+/** A flat triangle that has been set up for binned rasterization. */
+typedef struct {
+  // Inclusive pixel bounds
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+
+  // Barycentric coordinates (u, v, w)
+  // A pixel is inside when all three are nonnegative
+  plane_t bary[3];
+
+  // The fill color
+  color_t color;
+} setup_t;
+
+/** Set up a triangle for binned rasterization. Returns nonzero if it covers nothing. */
+static int triangle_setup(setup_t* s, const image_t* image, vec2_t a, vec2_t b, vec2_t c, color_t color) {
+  // Same bounding box that triangle() walks
+  s->x1 = (int) floorf(max(0, min(a.x, min(b.x, c.x))));
+  s->y1 = (int) floorf(max(0, min(a.y, min(b.y, c.y))));
+  s->x2 = (int) ceilf(min(image->width, max(a.x, max(b.x, c.x)))) - 1;
+  s->y2 = (int) ceilf(min(image->height, max(a.y, max(b.y, c.y)))) - 1;
+  s->color = color;
+
+  // Vector from A to B
+  vec2_t ab = {
+    .x = b.x - a.x,
+    .y = b.y - a.y,
+  };
+
+  // Vector from A to C
+  vec2_t ac = {
+    .x = c.x - a.x,
+    .y = c.y - a.y,
+  };
+
+  // Common denominator (see Cramer's rule)
+  float den = ab.x * ac.y - ac.x * ab.y;
+  if (den == 0 || s->x1 > s->x2 || s->y1 > s->y2) {
+    return 1;
+  }
+
+  // Cramer's rule again, but solved once as linear functions of the pixel position
+  s->bary[1] = (plane_t) {
+    .dx = ac.y / den,
+    .dy = -ac.x / den,
+    .c = (ac.x * a.y - a.x * ac.y) / den,
+  };
+  s->bary[2] = (plane_t) {
+    .dx = -ab.y / den,
+    .dy = ab.x / den,
+    .c = (a.x * ab.y - ab.x * a.y) / den,
+  };
+  s->bary[0] = (plane_t) {
+    .dx = -s->bary[1].dx - s->bary[2].dx,
+    .dy = -s->bary[1].dy - s->bary[2].dy,
+    .c = 1.0f - s->bary[1].c - s->bary[2].c,
+  };
+
+  return 0;
+}
+
+/** Edge length of a square screen tile. Triangles are binned per tile. */
+#define TILE_SIZE 64
+
+/** Edge length of a square block within a tile. Blocks are accepted or rejected as a whole. */
+#define BLOCK_SIZE 8
+
+/** How much of a rectangle a triangle covers. */
+typedef enum {
+  COVERAGE_NONE,
+  COVERAGE_PARTIAL,
+  COVERAGE_FULL,
+} coverage_t;
+
+/** Classify the pixels in [x1, x2] x [y1, y2] against a triangle's edges. */
+static coverage_t triangle_coverage(const setup_t* s, int x1, int y1, int x2, int y2) {
+  // The edge functions are linear, so their extremes over the rectangle are at its corners
+  coverage_t coverage = COVERAGE_FULL;
+  for (int i = 0; i < 3; ++i) {
+    int inside = (plane_at(s->bary[i], (float) x1, (float) y1) >= 0)
+        + (plane_at(s->bary[i], (float) x2, (float) y1) >= 0)
+        + (plane_at(s->bary[i], (float) x1, (float) y2) >= 0)
+        + (plane_at(s->bary[i], (float) x2, (float) y2) >= 0);
+
+    // All corners are outside one edge, so the whole rectangle is too
+    if (inside == 0) {
+      return COVERAGE_NONE;
+    }
+
+    // This edge cuts through the rectangle
+    if (inside < 4) {
+      coverage = COVERAGE_PARTIAL;
+    }
+  }
+  return coverage;
+}
+
+/** The triangles overlapping one screen tile, in submission order. */
+typedef struct {
+  int size;
+  int capacity;
+  int* triangles;
+} bin_t;
+
+/** Fill the part of a triangle that falls in one tile, a block at a time. */
+static void triangle_tile(image_t* image, const setup_t* s, int tile_x, int tile_y) {
+  // The part of the tile that the triangle's bounding box overlaps
+  int x1 = max(s->x1, tile_x);
+  int y1 = max(s->y1, tile_y);
+  int x2 = min(s->x2, tile_x + TILE_SIZE - 1);
+  int y2 = min(s->y2, tile_y + TILE_SIZE - 1);
+
+  // Visit the blocks in that part of the tile
+  // Blocks are aligned to the tile, which is aligned to the screen
+  for (int block_y = y1 - (y1 - tile_y) % BLOCK_SIZE; block_y <= y2; block_y += BLOCK_SIZE) {
+    for (int block_x = x1 - (x1 - tile_x) % BLOCK_SIZE; block_x <= x2; block_x += BLOCK_SIZE) {
+      int bx1 = max(x1, block_x);
+      int by1 = max(y1, block_y);
+      int bx2 = min(x2, block_x + BLOCK_SIZE - 1);
+      int by2 = min(y2, block_y + BLOCK_SIZE - 1);
+
+      switch (triangle_coverage(s, bx1, by1, bx2, by2)) {
+        case COVERAGE_NONE:
+          // Nothing to do here
+          break;
+        case COVERAGE_PARTIAL:
+          // Test each pixel like triangle() does
+          for (int y = by1; y <= by2; ++y) {
+            for (int x = bx1; x <= bx2; ++x) {
+              float u = plane_at(s->bary[0], (float) x, (float) y);
+              float v = plane_at(s->bary[1], (float) x, (float) y);
+              float w = plane_at(s->bary[2], (float) x, (float) y);
+              if (u >= 0 && v >= 0 && w >= 0) {
+                image_pixel(image, x, y) = s->color;
+              }
+            }
+          }
+          break;
+        case COVERAGE_FULL:
+          // Just fill it
+          for (int y = by1; y <= by2; ++y) {
+            for (int x = bx1; x <= bx2; ++x) {
+              image_pixel(image, x, y) = s->color;
+            }
+          }
+          break;
+      }
+    }
+  }
+}
+
+/** Fill a list of triangles in order by binning them into screen tiles. */
+static void triangles_tiled(image_t* image, const setup_t* setups, int count) {
+  int tiles_x = (image->width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (image->height + TILE_SIZE - 1) / TILE_SIZE;
+  bin_t* bins = calloc(tiles_x * tiles_y, sizeof(bin_t));
+
+  // Drop each triangle into the bins of the tiles it touches
+  for (int i = 0; i < count; ++i) {
+    const setup_t* s = &setups[i];
+    for (int tile_y = s->y1 / TILE_SIZE; tile_y <= s->y2 / TILE_SIZE; ++tile_y) {
+      for (int tile_x = s->x1 / TILE_SIZE; tile_x <= s->x2 / TILE_SIZE; ++tile_x) {
+        // Reject the tile outright if the triangle misses it
+        if (triangle_coverage(s, tile_x * TILE_SIZE, tile_y * TILE_SIZE, tile_x * TILE_SIZE + TILE_SIZE - 1, tile_y * TILE_SIZE + TILE_SIZE - 1) == COVERAGE_NONE) {
+          continue;
+        }
+
+        bin_t* bin = &bins[tile_x + tile_y * tiles_x];
+        if (bin->size == bin->capacity) {
+          bin->capacity = bin->capacity ? bin->capacity * 2 : 16;
+          bin->triangles = realloc(bin->triangles, bin->capacity * sizeof(int));
+        }
+        bin->triangles[bin->size] = i;
+        bin->size++;
+      }
+    }
+  }
+
+  // Then go tile by tile, drawing its triangles in the order they were submitted
+  for (int tile_y = 0; tile_y < tiles_y; ++tile_y) {
+    for (int tile_x = 0; tile_x < tiles_x; ++tile_x) {
+      bin_t* bin = &bins[tile_x + tile_y * tiles_x];
+      for (int i = 0; i < bin->size; ++i) {
+        triangle_tile(image, &setups[bin->triangles[i]], tile_x * TILE_SIZE, tile_y * TILE_SIZE);
+      }
+      free(bin->triangles);
+    }
+  }
+
+  free(bins);
+}
+
+int main(int argc, char* argv[]) {
+  // Read options
+  if (parse_options(argc, argv)) {
+    fprintf(stderr, "usage: %s [--raster=scan|tiled]\n", argv[0]);
+    return 1;
+  }
+
   // Allocate output image
   image_t image;
   image.width = 512;
@@ -197,6 +449,13 @@ int main(void) {
   // Close model file
   fclose(file);
 
+  // Triangles waiting to be binned, if the tiled rasterizer is in use
+  int setups_size = 0;
+  setup_t* setups = NULL;
+  if (options.raster == RASTER_TILED) {
+    setups = malloc(faces_size * sizeof(setup_t));
+  }
+
   // Iterate over triangular faces in model
   for (int i = 0; i < faces_size; ++i) {
     vec3_t face = faces[i];
@@ -242,19 +501,35 @@ int main(void) {
     // Compute lighting intensity with a forward lamp
     float lighting = dot3(normal, (vec3_t) {.x = 0, .y = 0, .z = 1});
 
+    // Its flat color
+    color_t color = {
+      .r = lighting * 255,
+      .g = lighting * 255,
+      .b = lighting * 255,
+      .a = 255,
+    };
+
     // If the triangle is forward-facing
     if (lighting > 0) {
       // Draw the transformed triangle to the output image
       // The great thing about triangles is that they stay triangles even after a mathematical shakedown
-      triangle(&image, p1_screen, p2_screen, p3_screen, (color_t) {
-        .r = lighting * 255,
-        .g = lighting * 255,
-        .b = lighting * 255,
-        .a = 255,
-      });
+      if (options.raster == RASTER_TILED) {
+        // Hold onto it until every triangle is ready to be binned
+        if (!triangle_setup(&setups[setups_size], &image, p1_screen, p2_screen, p3_screen, color)) {
+          setups_size++;
+        }
+      } else {
+        triangle(&image, p1_screen, p2_screen, p3_screen, color);
+      }
     }
   }
 
+  // Draw the binned triangles
+  if (options.raster == RASTER_TILED) {
+    triangles_tiled(&image, setups, setups_size);
+    free(setups);
+  }
+
   // Clean up model data
   free(faces);
   free(positions);
@@ -9,16 +9,492 @@
 // Rasterizer - Lesson 3
 //
 
+// Beyond C99 we use POSIX (pwrite, st_mtim) and madvise(), which glibc only declares when asked
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Vectorized span shaders are built where the compiler can target them
+// AVX2 is enabled per function and checked for at runtime, so the rest of the program stays portable
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_TGA
 #include "stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+// The Windows headers give us these, but nobody else does
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Inline whether the compiler thinks it is worth it or not, for functions specialized by constant arguments
+#if defined(__GNUC__)
+#define FORCE_INLINE inline static __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE static __forceinline
+#else
+#define FORCE_INLINE inline static
+#endif
+
+/** Rasterization strategies. */
+typedef enum {
+  /** Walk every pixel in each triangle's bounding box. */
+  RASTER_SCAN,
+
+  /** Bin triangles into screen tiles and accept or reject whole blocks of pixels. */
+  RASTER_TILED,
+} raster_mode_t;
+
+/** Instruction sets for the span shader. */
+typedef enum {
+  /** The best one the processor supports. */
+  SIMD_AUTO,
+
+  /** One pixel at a time. */
+  SIMD_SCALAR,
+
+  /** Four pixels at a time. */
+  SIMD_SSE2,
+
+  /** Eight pixels at a time. */
+  SIMD_AVX2,
+} simd_mode_t;
+
+/** Depth buffer formats. */
+typedef enum {
+  /** 16-bit unsigned normalized. */
+  DEPTH_D16,
+
+  /** 24-bit unsigned normalized, in the low bits of 32. */
+  DEPTH_D24,
+
+  /** 32-bit float. */
+  DEPTH_D32F,
+} depth_format_t;
+
+/** Shading strategies. */
+typedef enum {
+  /** Shade every fragment that passes the depth test as it is drawn. */
+  SHADING_FORWARD,
+
+  /** Draw depth alone first, then shade only the fragments that ended up visible. Where triangles tie on depth, the one drawn first is shaded, just as forward shading keeps it. */
+  SHADING_DEFERRED,
+
+  /** Draw which triangle is visible at each pixel, then shade the whole frame in one pass over it. */
+  SHADING_VISIBILITY,
+} shading_mode_t;
+
+/** Output file formats. */
+typedef enum {
+  /** Compressed, and readable anywhere. */
+  OUTPUT_PNG,
+
+  /** RGBA8 rows top to bottom with no header at all, for tools that are told the size. */
+  OUTPUT_RAW,
+
+  /** Binary RGB8 portable pixmap. Alpha is dropped. */
+  OUTPUT_PPM,
+
+  /** The Quite OK Image format, which is lossless and encodes many times faster than PNG. */
+  OUTPUT_QOI,
+} output_format_t;
+
+/** How the pixels of an image are laid out in memory. */
+typedef enum {
+  /** Row after row. Textures are read in this way. */
+  IMAGE_LINEAR,
+
+  /** In swizzled tiles. Render targets are kept this way. */
+  IMAGE_SWIZZLED,
+
+  /** In 4x4 blocks of texels, each filling one cache line. */
+  IMAGE_BLOCKED,
+
+  /** In Morton order, interleaving the bits of X and Y. */
+  IMAGE_MORTON,
+} image_layout_t;
+
+/** Renderer options. */
+static struct {
+  raster_mode_t raster;
+
+  /** Number of threads to render with, or zero for one per processor. */
+  int threads;
+
+  simd_mode_t simd;
+
+  /** Whether to keep parsed models in binary cache files next to them. */
+  int cache;
+
+  /** Whether to drop back-facing triangles in setup. */
+  int cull;
+
+  /** Whether the tiled rasterizer keeps a hierarchical depth buffer. */
+  int hiz;
+
+  /** Whether to sort triangles front to back before drawing them. */
+  int sort;
+
+  /** Whether textures get mip levels and are sampled trilinearly, rather than nearest from full size. */
+  int mipmaps;
+
+  /** How textures are laid out once they are read: linear, blocked or Morton. */
+  image_layout_t texture_layout;
+
+  shading_mode_t shading;
+
+  depth_format_t depth;
+
+  output_format_t output;
+
+  /** Number of frames to render, each written out while the next is drawn. */
+  int frames;
+
+  /** How hard to compress PNG output, from 0 (not at all) to 9. */
+  int png_level;
+
+  /** Number of threads to encode output with, or zero for as many as rendering uses. */
+  int png_threads;
+
+  /** Whether to print statistics about the frame. */
+  int stats;
+} options = {
+  .raster = RASTER_TILED,
+  .threads = 0,
+  .simd = SIMD_AUTO,
+  .cache = 1,
+  .cull = 1,
+  .hiz = 1,
+  .sort = 0,
+  .mipmaps = 1,
+  .texture_layout = IMAGE_BLOCKED,
+  .shading = SHADING_FORWARD,
+  .depth = DEPTH_D24,
+  .output = OUTPUT_PNG,
+  .frames = 1,
+  .png_level = 6,
+  .png_threads = 0,
+  .stats = 0,
+};
+
+/** Parse command line arguments into the options. */
+static int parse_options(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--raster=scan")) {
+      options.raster = RASTER_SCAN;
+    } else if (!strcmp(argv[i], "--raster=tiled")) {
+      options.raster = RASTER_TILED;
+    } else if (!strcmp(argv[i], "--simd=auto")) {
+      options.simd = SIMD_AUTO;
+    } else if (!strcmp(argv[i], "--simd=scalar")) {
+      options.simd = SIMD_SCALAR;
+    } else if (!strcmp(argv[i], "--simd=sse2")) {
+      options.simd = SIMD_SSE2;
+    } else if (!strcmp(argv[i], "--simd=avx2")) {
+      options.simd = SIMD_AVX2;
+    } else if (!strcmp(argv[i], "--cache=on")) {
+      options.cache = 1;
+    } else if (!strcmp(argv[i], "--cache=off")) {
+      options.cache = 0;
+    } else if (!strcmp(argv[i], "--cull=back")) {
+      options.cull = 1;
+    } else if (!strcmp(argv[i], "--cull=none")) {
+      options.cull = 0;
+    } else if (!strcmp(argv[i], "--hiz=on")) {
+      options.hiz = 1;
+    } else if (!strcmp(argv[i], "--hiz=off")) {
+      options.hiz = 0;
+    } else if (!strcmp(argv[i], "--sort=front")) {
+      options.sort = 1;
+    } else if (!strcmp(argv[i], "--sort=none")) {
+      options.sort = 0;
+    } else if (!strcmp(argv[i], "--mipmaps=on")) {
+      options.mipmaps = 1;
+    } else if (!strcmp(argv[i], "--mipmaps=off")) {
+      options.mipmaps = 0;
+    } else if (!strcmp(argv[i], "--texture-layout=linear")) {
+      options.texture_layout = IMAGE_LINEAR;
+    } else if (!strcmp(argv[i], "--texture-layout=blocked")) {
+      options.texture_layout = IMAGE_BLOCKED;
+    } else if (!strcmp(argv[i], "--texture-layout=morton")) {
+      options.texture_layout = IMAGE_MORTON;
+    } else if (!strcmp(argv[i], "--shading=forward")) {
+      options.shading = SHADING_FORWARD;
+    } else if (!strcmp(argv[i], "--shading=deferred")) {
+      options.shading = SHADING_DEFERRED;
+    } else if (!strcmp(argv[i], "--shading=visibility")) {
+      options.shading = SHADING_VISIBILITY;
+    } else if (!strcmp(argv[i], "--depth=d16")) {
+      options.depth = DEPTH_D16;
+    } else if (!strcmp(argv[i], "--depth=d24")) {
+      options.depth = DEPTH_D24;
+    } else if (!strcmp(argv[i], "--depth=d32f")) {
+      options.depth = DEPTH_D32F;
+    } else if (!strcmp(argv[i], "--output=png")) {
+      options.output = OUTPUT_PNG;
+    } else if (!strcmp(argv[i], "--output=raw")) {
+      options.output = OUTPUT_RAW;
+    } else if (!strcmp(argv[i], "--output=ppm")) {
+      options.output = OUTPUT_PPM;
+    } else if (!strcmp(argv[i], "--output=qoi")) {
+      options.output = OUTPUT_QOI;
+    } else if (!strcmp(argv[i], "--stats")) {
+      options.stats = 1;
+    } else if (!strncmp(argv[i], "--threads=", 10)) {
+      char* end;
+      options.threads = (int) strtol(argv[i] + 10, &end, 10);
+      if (*end || options.threads < 0) {
+        fprintf(stderr, "error: bad thread count: %s\n", argv[i] + 10);
+        return -1;
+      }
+    } else if (!strncmp(argv[i], "--frames=", 9)) {
+      char* end;
+      options.frames = (int) strtol(argv[i] + 9, &end, 10);
+      if (*end || options.frames < 1) {
+        fprintf(stderr, "error: bad frame count: %s\n", argv[i] + 9);
+        return -1;
+      }
+    } else if (!strncmp(argv[i], "--png-level=", 12)) {
+      char* end;
+      options.png_level = (int) strtol(argv[i] + 12, &end, 10);
+      if (*end || options.png_level < 0 || options.png_level > 9) {
+        fprintf(stderr, "error: bad compression level: %s\n", argv[i] + 12);
+        return -1;
+      }
+    } else if (!strncmp(argv[i], "--png-threads=", 14)) {
+      char* end;
+      options.png_threads = (int) strtol(argv[i] + 14, &end, 10);
+      if (*end || options.png_threads < 0) {
+        fprintf(stderr, "error: bad thread count: %s\n", argv[i] + 14);
+        return -1;
+      }
+    } else {
+      fprintf(stderr, "error: unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Get the number of threads to use for parallel work. */
+static int thread_count(void) {
+  if (options.threads > 0) {
+    return options.threads;
+  }
+
+  // Default to one thread per online processor
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return processors > 0 ? (int) processors : 1;
+}
+
+/** Arguments for a thread started by parallel_run(). */
+typedef struct {
+  void (*job)(void* arg, int index);
+  void* arg;
+  int index;
+} parallel_thread_t;
+
+/** Entry point for threads started by parallel_run(). */
+static void* parallel_thread(void* arg) {
+  parallel_thread_t* thread = arg;
+  thread->job(thread->arg, thread->index);
+  return NULL;
+}
+
+/** Run a job on several threads at once and wait for all of them. Each thread gets its own index. */
+static void parallel_run(int threads, void (*job)(void* arg, int index), void* arg) {
+  // The calling thread takes index zero, so a single thread costs nothing extra
+  pthread_t* handles = malloc(threads * sizeof(pthread_t));
+  parallel_thread_t* args = malloc(threads * sizeof(parallel_thread_t));
+  for (int i = 1; i < threads; ++i) {
+    args[i] = (parallel_thread_t) {
+      .job = job,
+      .arg = arg,
+      .index = i,
+    };
+    if (pthread_create(&handles[i], NULL, parallel_thread, &args[i])) {
+      fprintf(stderr, "error: failed to start thread\n");
+      exit(1);
+    }
+  }
+  job(arg, 0);
+  for (int i = 1; i < threads; ++i) {
+    pthread_join(handles[i], NULL);
+  }
+  free(args);
+  free(handles);
+}
+
+/**
+ * A double-ended queue over a range of work items [head, tail).
+ *
+ * Each worker owns one of these. It takes its own work from the head, while
+ * idle workers steal from the tail, so the two rarely meet.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} deque_t;
+
+/** Take an item from the head of a queue. Returns -1 if it is empty. */
+static int deque_take(deque_t* queue) {
+  pthread_mutex_lock(&queue->lock);
+  int item = queue->head < queue->tail ? queue->head++ : -1;
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+/** Steal an item from the tail of a queue. Returns -1 if it is empty. */
+static int deque_steal(deque_t* queue) {
+  pthread_mutex_lock(&queue->lock);
+  int item = queue->head < queue->tail ? --queue->tail : -1;
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+/** Get the next work item for a worker, stealing from the others once its own queue runs dry. */
+static int deque_next(deque_t* queues, int count, int self) {
+  int item = deque_take(&queues[self]);
+
+  // Items are never added after the start, so one empty sweep means we are done
+  for (int i = 1; item < 0 && i < count; ++i) {
+    item = deque_steal(&queues[(self + i) % count]);
+  }
+  return item;
+}
+
+/** Bits sorted on per radix sort pass. */
+#define RADIX_BITS 8
+
+/** Number of buckets per radix sort pass. */
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/** Minimum number of keys worth giving a thread of its own in a radix sort. */
+#define RADIX_CHUNK_SIZE 65536
+
+/** Everything the workers need for one pass of a radix sort. */
+typedef struct {
+  const uint32_t* keys_in;
+  const uint32_t* values_in;
+  uint32_t* keys_out;
+  uint32_t* values_out;
+  int size;
+  int chunks;
+  int shift;
+
+  // Per chunk, first the number of keys in each bucket, then where the chunk's share of each bucket starts
+  int (*buckets)[RADIX_SIZE];
+} radix_job_t;
+
+/** Count the keys of one chunk into buckets. */
+static void radix_count_worker(void* arg, int index) {
+  radix_job_t* job = arg;
+  int* buckets = job->buckets[index];
+  memset(buckets, 0, RADIX_SIZE * sizeof(int));
+
+  int begin = (int) ((int64_t) job->size * index / job->chunks);
+  int end = (int) ((int64_t) job->size * (index + 1) / job->chunks);
+  for (int i = begin; i < end; ++i) {
+    buckets[(job->keys_in[i] >> job->shift) & (RADIX_SIZE - 1)]++;
+  }
+}
+
+/** Move the keys of one chunk to where their buckets start. */
+static void radix_scatter_worker(void* arg, int index) {
+  radix_job_t* job = arg;
+  int* buckets = job->buckets[index];
+
+  int begin = (int) ((int64_t) job->size * index / job->chunks);
+  int end = (int) ((int64_t) job->size * (index + 1) / job->chunks);
+  for (int i = begin; i < end; ++i) {
+    int at = buckets[(job->keys_in[i] >> job->shift) & (RADIX_SIZE - 1)]++;
+    job->keys_out[at] = job->keys_in[i];
+    job->values_out[at] = job->values_in[i];
+  }
+}
+
+/**
+ * Sort values by their keys in ascending order, a byte of the key at a time.
+ *
+ * Every pass is stable, so values with equal keys keep their order. Each
+ * pass counts and then scatters the keys in chunks on several threads.
+ * Passes whose byte is the same for every key are skipped.
+ */
+static void radix_sort(uint32_t* keys, uint32_t* values, int size) {
+  uint32_t* keys_temp = malloc(size * sizeof(uint32_t));
+  uint32_t* values_temp = malloc(size * sizeof(uint32_t));
+  radix_job_t job = {
+    .keys_in = keys,
+    .values_in = values,
+    .keys_out = keys_temp,
+    .values_out = values_temp,
+    .size = size,
+    .chunks = min(thread_count(), size / RADIX_CHUNK_SIZE + 1),
+  };
+  job.buckets = malloc(job.chunks * sizeof(*job.buckets));
+
+  for (job.shift = 0; job.shift < 32; job.shift += RADIX_BITS) {
+    parallel_run(job.chunks, radix_count_worker, &job);
+
+    // Turn the counts into starting points, bucket by bucket and then chunk by chunk within each
+    int at = 0;
+    int skip = 0;
+    for (int bucket = 0; bucket < RADIX_SIZE; ++bucket) {
+      int start = at;
+      for (int chunk = 0; chunk < job.chunks; ++chunk) {
+        int count = job.buckets[chunk][bucket];
+        job.buckets[chunk][bucket] = at;
+        at += count;
+      }
+      skip |= at - start == size;
+    }
+    if (skip) {
+      continue;
+    }
+
+    parallel_run(job.chunks, radix_scatter_worker, &job);
+
+    // The output of this pass is the input of the next
+    uint32_t* keys_in = job.keys_out;
+    uint32_t* values_in = job.values_out;
+    job.keys_out = (uint32_t*) job.keys_in;
+    job.values_out = (uint32_t*) job.values_in;
+    job.keys_in = keys_in;
+    job.values_in = values_in;
+  }
+
+  // Make sure the result ends up where it was asked for
+  if (job.keys_in != keys) {
+    memcpy(keys, job.keys_in, size * sizeof(uint32_t));
+    memcpy(values, job.values_in, size * sizeof(uint32_t));
+  }
+
+  free(job.buckets);
+  free(values_temp);
+  free(keys_temp);
+}
 
 /** An RGBA8 color. */
 typedef union {
@@ -31,17 +507,180 @@ typedef union {
   int32_t value;
 } color_t;
 
+/**
+ * Edge length of the square tiles render targets are stored in, as a power of two.
+ *
+ * Render targets keep their pixels tile after tile, and row by row within a
+ * tile, so pixels near each other on screen are near each other in memory.
+ * A row of a tile is exactly one AVX2 vector of 32-bit values. Only whole
+ * tiles are stored, so buffers are padded out past their right and bottom
+ * edges.
+ */
+#define SWIZZLE_BITS 3
+#define SWIZZLE_SIZE (1 << SWIZZLE_BITS)
+
+/** Count the swizzled tiles along an edge of a buffer. */
+FORCE_INLINE size_t swizzle_tiles(int size) {
+  return (size_t) (size + SWIZZLE_SIZE - 1) >> SWIZZLE_BITS;
+}
+
+/** Count the values stored for a swizzled buffer, padding included. */
+static size_t swizzle_size(int width, int height) {
+  return swizzle_tiles(width) * swizzle_tiles(height) * SWIZZLE_SIZE * SWIZZLE_SIZE;
+}
+
+/** Get which swizzled tile pixel (x, y) is in. */
+FORCE_INLINE size_t swizzle_tile(int x, int y, int width) {
+  return (size_t) (y >> SWIZZLE_BITS) * swizzle_tiles(width) + (size_t) (x >> SWIZZLE_BITS);
+}
+
+/** Get where the value for pixel (x, y) is stored in a swizzled buffer. */
+FORCE_INLINE size_t swizzle_index(int x, int y, int width) {
+  return swizzle_tile(x, y, width) << (2 * SWIZZLE_BITS) | (size_t) (y & (SWIZZLE_SIZE - 1)) << SWIZZLE_BITS | (size_t) (x & (SWIZZLE_SIZE - 1));
+}
+
+/** Texels along an edge of a texture block. A block of 4x4 texels is 64 bytes, which is a cache line. */
+#define TEXTURE_BLOCK_BITS 2
+#define TEXTURE_BLOCK_SIZE (1 << TEXTURE_BLOCK_BITS)
+
+/** Count the blocks along an edge of a blocked texture. */
+FORCE_INLINE size_t texture_blocks(int size) {
+  return (size_t) (size + TEXTURE_BLOCK_SIZE - 1) >> TEXTURE_BLOCK_BITS;
+}
+
+/** Get where the value for texel (x, y) is stored in a blocked texture. */
+FORCE_INLINE size_t texture_block_index(int x, int y, int width) {
+  size_t block = (size_t) (y >> TEXTURE_BLOCK_BITS) * texture_blocks(width) + (size_t) (x >> TEXTURE_BLOCK_BITS);
+  return block << (2 * TEXTURE_BLOCK_BITS) | (size_t) (y & (TEXTURE_BLOCK_SIZE - 1)) << TEXTURE_BLOCK_BITS | (size_t) (x & (TEXTURE_BLOCK_SIZE - 1));
+}
+
+/** Spread the low 16 bits of a value out to its even bits. */
+FORCE_INLINE uint32_t morton_spread(uint32_t value) {
+  value &= 0x0000ffff;
+  value = (value | value << 8) & 0x00ff00ff;
+  value = (value | value << 4) & 0x0f0f0f0f;
+  value = (value | value << 2) & 0x33333333;
+  value = (value | value << 1) & 0x55555555;
+  return value;
+}
+
+/** Get where the value for texel (x, y) is stored in a Morton-ordered texture. */
+FORCE_INLINE size_t morton_index(int x, int y) {
+  return morton_spread((uint32_t) x) | morton_spread((uint32_t) y) << 1;
+}
+
+/** Count the values stored for a Morton-ordered texture, which fills out the power of two square around it. */
+static size_t morton_size(int width, int height) {
+  size_t size = 1;
+  while (size < (size_t) width || size < (size_t) height) {
+    size <<= 1;
+  }
+  return size * size;
+}
+
 /** A simple image. */
 typedef struct {
   int width;
   int height;
+  image_layout_t layout;
   color_t* pixels;
+
+  // Swizzled images are cleared lazily, one flag per tile that has yet to be filled with the clear color
+  uint8_t* pending;
+  color_t clear;
 } image_t;
 
-/** Access a pixel in an image. */
+/** Access a pixel in a linear image. */
 #define image_pixel(image, x, y) \
     ((image_t*) (image))->pixels[(int) x + (int) (y) * ((image_t*) image)->width]
 
+/** Access a pixel in a swizzled image. */
+#define image_pixel_swizzled(image, x, y) \
+    ((image_t*) (image))->pixels[swizzle_index((int) (x), (int) (y), ((image_t*) image)->width)]
+
+/** Get where the value for pixel (x, y) is stored in an image of any layout. */
+FORCE_INLINE size_t image_index(const image_t* image, int x, int y) {
+  switch (image->layout) {
+    case IMAGE_LINEAR:
+      break;
+    case IMAGE_SWIZZLED:
+      return swizzle_index(x, y, image->width);
+    case IMAGE_BLOCKED:
+      return texture_block_index(x, y, image->width);
+    case IMAGE_MORTON:
+      return morton_index(x, y);
+  }
+  return (size_t) x + (size_t) y * image->width;
+}
+
+/** Access a pixel in an image of any layout. Textures are read this way. */
+#define image_texel(image, x, y) \
+    (image)->pixels[image_index((image), (x), (y))]
+
+/** Allocate an image. The pixels are left uninitialized. */
+static void image_alloc(image_t* image, int width, int height, image_layout_t layout) {
+  image->width = width;
+  image->height = height;
+  image->layout = layout;
+  image->pending = NULL;
+  size_t size = (size_t) width * height;
+  switch (layout) {
+    case IMAGE_LINEAR:
+      break;
+    case IMAGE_SWIZZLED:
+      size = swizzle_size(width, height);
+      break;
+    case IMAGE_BLOCKED:
+      size = texture_blocks(width) * texture_blocks(height) * TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE;
+      break;
+    case IMAGE_MORTON:
+      size = morton_size(width, height);
+      break;
+  }
+  image->pixels = malloc(size * sizeof(color_t));
+}
+
+/** Lay an image out again in another layout. */
+static void image_relayout(image_t* image, image_layout_t layout) {
+  image_t out;
+  image_alloc(&out, image->width, image->height, layout);
+  for (int y = 0; y < image->height; ++y) {
+    for (int x = 0; x < image->width; ++x) {
+      image_texel(&out, x, y) = image_texel(image, x, y);
+    }
+  }
+  free(image->pixels);
+  *image = out;
+}
+
+/**
+ * Clear a swizzled image to a color.
+ *
+ * Nothing is written yet. Each tile is filled the first time something is
+ * drawn to it, or when the image is written out, so tiles nothing is drawn
+ * to are only ever written once.
+ */
+static void image_clear(image_t* image, color_t color) {
+  size_t tiles = swizzle_tiles(image->width) * swizzle_tiles(image->height);
+  if (!image->pending) {
+    image->pending = malloc(tiles);
+  }
+  memset(image->pending, 1, tiles);
+  image->clear = color;
+}
+
+/** Fill the swizzled tile holding pixel (x, y) with the clear color, if that is still pending. */
+FORCE_INLINE void image_materialize(image_t* image, int x, int y) {
+  size_t tile = swizzle_tile(x, y, image->width);
+  if (image->pending[tile]) {
+    color_t* pixels = &image->pixels[tile << (2 * SWIZZLE_BITS)];
+    for (int i = 0; i < SWIZZLE_SIZE * SWIZZLE_SIZE; ++i) {
+      pixels[i] = image->clear;
+    }
+    image->pending[tile] = 0;
+  }
+}
+
 /** Read an image from a file. */
 static int image_read(image_t* image, const char* filename) {
   // Try to load data from the file
@@ -55,13 +694,12 @@ static int image_read(image_t* image, const char* filename) {
 
   // Rearrange up the image data like we will need
   // The caller is responsible for cleaning up the pixel data
-  image->width = width;
-  image->height = height;
-  image->pixels = malloc(image->width * image->height * sizeof(color_t));
+  image_alloc(image, width, height, IMAGE_LINEAR);
   for (int x = 0; x < image->width; ++x) {
     for (int y = 0; y < image->height; ++y) {
       // Compute pixel offset
-      int pixel = (x + (image->height - y) * image->width) * 3;
+      // Rows are flipped so that Y points up, which puts row 0 of the file at the top row of the texture
+      int pixel = (x + (image->height - 1 - y) * image->width) * 3;
 
       // Extract R, G, and B data
       // The alpha channel is assumed fully opaque
@@ -80,395 +718,3999 @@ static int image_read(image_t* image, const char* filename) {
   return 0;
 }
 
-/** Write an image to a PNG file. */
-static int image_write_png(const image_t* image, const char* filename) {
-  return !stbi_write_png(filename, image->width, image->height, 4, image->pixels, 0);
-}
+/** Most mip levels a texture can have, which is enough for 32768 texels across. */
+#define TEXTURE_LEVELS_MAX 16
 
-/** 2D vector. */
+/**
+ * A texture, with its mip levels.
+ *
+ * Level 0 is the image as it was read, and each level after it is half the
+ * size of the one before, down to a single texel. Far away surfaces then
+ * read from a small level, which stays in cache, rather than skipping
+ * across the full-size image.
+ */
 typedef struct {
-  float x;
-  float y;
-} vec2_t;
+  int levels;
+  image_t level[TEXTURE_LEVELS_MAX];
+} texture_t;
 
-/** 3D vector. */
-typedef struct {
-  float x;
-  float y;
-  float z;
-} vec3_t;
+/** Fill a mip level by averaging each 2x2 block of the level above it. Odd edges repeat their last texel. */
+static void texture_downsample(image_t* level, const image_t* above) {
+  for (int y = 0; y < level->height; ++y) {
+    const color_t* row1 = &image_pixel(above, 0, min(2 * y, above->height - 1));
+    const color_t* row2 = &image_pixel(above, 0, min(2 * y + 1, above->height - 1));
+    color_t* out = &image_pixel(level, 0, y);
+    for (int x = 0; x < level->width; ++x) {
+      int x1 = min(2 * x, above->width - 1);
+      int x2 = min(2 * x + 1, above->width - 1);
+      color_t a = row1[x1];
+      color_t b = row1[x2];
+      color_t c = row2[x1];
+      color_t d = row2[x2];
 
-/** Dot product between two 3-vectors. */
-inline static float dot3(vec3_t a, vec3_t b) {
-  return a.x * b.x + a.y * b.y + a.z * b.z;
+      // Round to nearest
+      out[x] = (color_t) {
+        .r = (uint8_t) ((a.r + b.r + c.r + d.r + 2) >> 2),
+        .g = (uint8_t) ((a.g + b.g + c.g + d.g + 2) >> 2),
+        .b = (uint8_t) ((a.b + b.b + c.b + d.b + 2) >> 2),
+        .a = (uint8_t) ((a.a + b.a + c.a + d.a + 2) >> 2),
+      };
+    }
+  }
 }
 
-/** Cross product between two 3-vectors. */
-inline static vec3_t cross3(vec3_t a, vec3_t b) {
-  return (vec3_t) {
-    .x = a.y * b.z - a.z * b.y,
-    .y = a.z * b.x - a.x * b.z,
-    .z = a.x * b.y - a.y * b.x,
-  };
+/** Read a texture from a file, building its mip levels unless they are turned off, then lay them out for sampling. */
+static int texture_read(texture_t* texture, const char* filename) {
+  if (image_read(&texture->level[0], filename)) {
+    return -1;
+  }
+
+  texture->levels = 1;
+  while (options.mipmaps && texture->levels < TEXTURE_LEVELS_MAX) {
+    const image_t* above = &texture->level[texture->levels - 1];
+    if (above->width == 1 && above->height == 1) {
+      break;
+    }
+    image_t* level = &texture->level[texture->levels++];
+    image_alloc(level, max(above->width / 2, 1), max(above->height / 2, 1), IMAGE_LINEAR);
+    texture_downsample(level, above);
+  }
+
+  // Samples near each other on screen are near each other in the texture, but not necessarily along a row
+  // Blocks keep texels that are close in both directions close in memory too
+  if (options.texture_layout != IMAGE_LINEAR) {
+    for (int i = 0; i < texture->levels; ++i) {
+      image_relayout(&texture->level[i], options.texture_layout);
+    }
+  }
+
+  return 0;
 }
 
-/** Normalize a 3-vector. */
-inline static vec3_t norm3(vec3_t v) {
-  float mag = sqrtf(dot3(v, v));
-  return (vec3_t) {
-    .x = v.x / mag,
-    .y = v.y / mag,
-    .z = v.z / mag,
-  };
+/** Free the levels of a texture. */
+static void texture_free(texture_t* texture) {
+  for (int i = 0; i < texture->levels; ++i) {
+    free(texture->level[i].pixels);
+  }
 }
 
-/** Fill a triangle. */
-static void triangle(image_t* o_color, image_t* o_depth, vec3_t a, vec2_t at, vec3_t an, vec3_t b, vec2_t bt, vec3_t bn, vec3_t c, vec2_t ct, vec3_t cn, const image_t* texture) {
-  // Opposite corners of bounding box wrapping the triangle
-  // These are clipped at the color buffer boundaries
-  vec2_t aabb1 = {
-    .x = max(0.0f, min(a.x, min(b.x, c.x))),
-    .y = max(0.0f, min(a.y, min(b.y, c.y))),
+/**
+ * Pick the mip level to sample a triangle from.
+ *
+ * Takes how far the texture coordinates move for a step of one pixel along
+ * X and along Y. The level is where the longer step is about a texel, and
+ * fractional levels blend the two levels around them.
+ */
+static float texture_lod(const texture_t* texture, float dudx, float dvdx, float dudy, float dvdy) {
+  float width = (float) texture->level[0].width;
+  float height = (float) texture->level[0].height;
+  float x = dudx * width * dudx * width + dvdx * height * dvdx * height;
+  float y = dudy * width * dudy * width + dvdy * height * dvdy * height;
+
+  // Half the log of the squared length is the log of the length
+  float lod = 0.5f * log2f(max(max(x, y), 1.0f));
+  return min(lod, (float) (texture->levels - 1));
+}
+
+/** Add the four texels around (u, v) in a mip level into sum, bilinearly weighted and scaled by weight. Texels past the edges repeat the edges. */
+FORCE_INLINE void texture_bilinear(const image_t* level, float u, float v, float weight, float sum[3]) {
+  float x = u * (float) level->width - 0.5f;
+  float y = v * (float) level->height - 0.5f;
+
+  // Truncation rounds toward zero, so step back one where that rounded up, which is floorf() without the call
+  int x0 = (int) x;
+  int y0 = (int) y;
+  x0 -= (float) x0 > x;
+  y0 -= (float) y0 > y;
+  float fx = x - (float) x0;
+  float fy = y - (float) y0;
+  int x1 = min(max(x0, 0), level->width - 1);
+  int x2 = min(max(x0 + 1, 0), level->width - 1);
+  int y1 = min(max(y0, 0), level->height - 1);
+  int y2 = min(max(y0 + 1, 0), level->height - 1);
+
+  color_t texels[4] = {
+    image_texel(level, x1, y1),
+    image_texel(level, x2, y1),
+    image_texel(level, x1, y2),
+    image_texel(level, x2, y2),
   };
-  vec2_t aabb2 = {
-    .x = min((float) o_color->width, max(a.x, max(b.x, c.x))),
-    .y = min((float) o_color->height, max(a.y, max(b.y, c.y))),
+  float weights[4] = {
+    (1.0f - fx) * (1.0f - fy) * weight,
+    fx * (1.0f - fy) * weight,
+    (1.0f - fx) * fy * weight,
+    fx * fy * weight,
   };
+  for (int i = 0; i < 4; ++i) {
+    sum[0] += (float) texels[i].r * weights[i];
+    sum[1] += (float) texels[i].g * weights[i];
+    sum[2] += (float) texels[i].b * weights[i];
+  }
+}
 
-  // The vector AB
-  vec2_t ab = {
-    .x = b.x - a.x,
-    .y = b.y - a.y,
-  };
+/**
+ * Sample a texture at (u, v) with trilinear filtering.
+ *
+ * Blends bilinear samples from the two mip levels around lod, which comes
+ * from texture_lod(). Textures are read fully opaque, so alpha is too.
+ */
+FORCE_INLINE color_t texture_sample(const texture_t* texture, float u, float v, float lod) {
+  int level = (int) lod;
+  float blend = lod - (float) level;
 
-  // The vector AC
-  vec2_t ac = {
-    .x = c.x - a.x,
-    .y = c.y - a.y,
+  float sum[3] = {0, 0, 0};
+  texture_bilinear(&texture->level[level], u, v, 1.0f - blend, sum);
+  if (blend > 0) {
+    texture_bilinear(&texture->level[level + 1], u, v, blend, sum);
+  }
+  return (color_t) {
+    .r = (uint8_t) (sum[0] + 0.5f),
+    .g = (uint8_t) (sum[1] + 0.5f),
+    .b = (uint8_t) (sum[2] + 0.5f),
+    .a = 255,
   };
+}
 
-  // Iterate over the bounding box
-  // We will check each of its interior pixels if it belongs to the triangle
-  for (int x = (int) aabb1.x; x <= (int) (0.5f + aabb2.x); ++x) {
-    for (int y = (int) aabb1.y; y <= (int) (0.5f + aabb2.y); ++y) {
-      // The vector AP
-      vec2_t ap = {
-        (float) x - a.x,
-        (float) y - a.y,
-      };
+/** Copy rows [y1, y2) of an image out in order. Tiles of a swizzled image still waiting to be cleared are filled in on the way. */
+static void image_copy_rows(const image_t* image, int y1, int y2, color_t* out) {
+  if (image->layout == IMAGE_LINEAR) {
+    memcpy(out, &image->pixels[(size_t) y1 * image->width], (size_t) (y2 - y1) * image->width * sizeof(color_t));
+    return;
+  }
 
-      // Find normalized barycentric coordinates tuple (u, v, w)
-      // This is a solution using Cramer's rule instead of the thingamabob in the lesson
-      float denominator = (float) (ab.x * ac.y - ac.x * ab.y);
-      float v = (float) (ap.x * ac.y - ac.x * ap.y) / denominator;
-      float w = (float) (ab.x * ap.y - ap.x * ab.y) / denominator;
-      float u = 1.0f - v - w;
-
-      // If all components are nonnegative, we are inside
-      if (u >= 0 && v >= 0 && w >= 0) {
-        // Compute depth of this pixel
-        float depth = u * a.z + v * b.z + w * c.z;
-
-        // If this pixel is above the pixel already drawn here, then draw it
-        if (depth > image_pixel(o_depth, x, y).value) {
-          // Interpolate the texture coordinates for this fragment
-          vec2_t texcoord = {
-            .x = u * at.x + v * bt.x + w * ct.x,
-            .y = u * at.y + v * bt.y + w * ct.y,
-          };
-
-          // Interpolate the normal vector for this fragment
-          vec3_t normal = {
-            .x = u * an.x + v * bn.x + w * cn.x,
-            .y = u * an.y + v * bn.y + w * cn.y,
-            .z = u * an.z + v * bn.z + w * cn.z,
-          };
-
-          // Look up the texture color
-          int tx = (int) (texcoord.x * (float) texture->width);
-          int ty = (int) (texcoord.y * (float) texture->height);
-          color_t color = image_pixel(texture, tx, ty);
-
-          // Compute lighting intensity with a forward lamp
-          float lighting = dot3(normal, (vec3_t) {.x = 0, .y = 0, .z = 1});
-
-          // Light the fragment
-          color.r *= lighting;
-          color.g *= lighting;
-          color.b *= lighting;
-
-          // If the triangle is forward-facing
-          if (lighting > 0) {
-            // Write image data out
-            image_pixel(o_color, x, y) = color;
-            image_pixel(o_depth, x, y).value = depth;
-          }
+  // Each row of a tile is contiguous, so copy a tile's width at a time
+  for (int y = y1; y < y2; ++y) {
+    for (int x = 0; x < image->width; x += SWIZZLE_SIZE) {
+      color_t* row = &out[x + (size_t) (y - y1) * image->width];
+      int count = min(SWIZZLE_SIZE, image->width - x);
+      if (image->pending && image->pending[swizzle_tile(x, y, image->width)]) {
+        for (int i = 0; i < count; ++i) {
+          row[i] = image->clear;
         }
+      } else {
+        memcpy(row, &image_pixel_swizzled(image, x, y), count * sizeof(color_t));
       }
     }
   }
 }
 
-/** Draw the head model. */
-static void draw(image_t* o_color, image_t* o_depth) {
-  // Vertex position data
-  int positions_capacity = 10;
-  int positions_size = 0;
-  vec3_t* positions = malloc(positions_capacity * sizeof(vec3_t));
-
-  // Vertex texture coordinate data
-  int texcoords_capacity = 10;
-  int texcoords_size = 0;
-  vec2_t* texcoords = malloc(texcoords_capacity * sizeof(vec2_t));
-
-  // Vertex normal coordinate data
-  int normals_capacity = 10;
-  int normals_size = 0;
-  vec3_t* normals = malloc(normals_capacity * sizeof(vec3_t));
-
-  /** A triangular face. */
-  typedef struct {
-    struct {
-      int position;
-      int texcoord;
-      int normal;
-    } a;
-    struct {
-      int position;
-      int texcoord;
-      int normal;
-    } b;
-    struct {
-      int position;
-      int texcoord;
-      int normal;
-    } c;
-  } face_t;
-
-  // Face data
-  int faces_capacity = 10;
-  int faces_size = 0;
-  face_t* faces = malloc(faces_capacity * sizeof(face_t));
+/** Farthest back a deflate match can reach. */
+#define DEFLATE_WINDOW 32768
 
-  // Open up our model file for read
-  FILE* file = fopen("data/african_head.obj", "r");
-  if (!file) {
-    fprintf(stderr, "error: failed to open model file\n");
-    exit(1);
-  }
+/** Shortest and longest deflate matches. */
+#define DEFLATE_MATCH_MIN 3
+#define DEFLATE_MATCH_MAX 258
 
-  // Crudely parse model data from the file into memory
-  // I am making so many assumptions here it's not even funny
-  char line[256];
-  while (fgets(line, 256, file)) {
-    // Ignore comment lines
-    if (line[0] == '#') {
-      continue;
-    }
+/** Bits in the hash used to find deflate matches. */
+#define DEFLATE_HASH_BITS 15
 
-    // Deal with meaningful lines
-    if (line[0] == 'v' && line[1] == ' ') {
-      // This line encodes a position vector
+/** Shortest length and extra bits of each deflate length symbol, from 257 up. */
+static const uint16_t deflate_length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t deflate_length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
 
-      // Parse the line
-      vec3_t position;
-      sscanf(line, "v %f %f %f", &position.x, &position.y, &position.z);
+/** Shortest distance and extra bits of each deflate distance symbol. */
+static const uint16_t deflate_distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t deflate_distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
 
-      // Store the parsed data
-      if (positions_size == positions_capacity) {
-        positions_capacity *= 2;
-        positions = realloc(positions, positions_capacity * sizeof(vec3_t));
-      }
-      positions[positions_size] = position;
-      positions_size++;
-    } else if (line[0] == 'v' && line[1] == 't' && line[2] == ' ') {
-      // This line encodes a texture coordinate vector
+/** Lookup tables for writing PNG files. These are filled in once by png_tables_init(), before any thread needs them. */
+static struct {
+  int ready;
 
-      // Parse the line
-      float _;
-      vec2_t texcoord;
-      sscanf(line, "vt %f %f %f", &texcoord.x, &texcoord.y, &_);
+  /** CRC-32 of each byte, for chunk checksums. */
+  uint32_t crc[256];
 
-      // Store the parsed data
-      if (texcoords_size == texcoords_capacity) {
-        texcoords_capacity *= 2;
-        texcoords = realloc(texcoords, texcoords_capacity * sizeof(vec3_t));
-      }
-      texcoords[texcoords_size] = texcoord;
-      texcoords_size++;
-    } else if (line[0] == 'v' && line[1] == 'n' && line[2] == ' ') {
-      // This line encodes a normal vector
+  /** The fixed Huffman code of each literal and length symbol, bit reversed, and its length. */
+  uint16_t codes[288];
+  uint8_t code_lengths[288];
 
-      // Parse the line
-      vec3_t normal;
-      sscanf(line, "vn %f %f %f", &normal.x, &normal.y, &normal.z);
+  /** The symbol for each match length, less DEFLATE_MATCH_MIN. */
+  uint8_t length_symbols[256];
 
-      // Store the parsed data
-      if (normals_size == normals_capacity) {
-        normals_capacity *= 2;
-        normals = realloc(normals, normals_capacity * sizeof(vec3_t));
-      }
-      normals[normals_size] = normal;
-      normals_size++;
-    } else if (line[0] == 'f' && line[1] == ' ') {
-      // This line encodes a face
+  /** The symbol for each distance d, at d - 1 up to 256 and at 256 + (d - 1) / 128 past that. */
+  uint8_t distance_symbols[512];
+} png_tables;
 
-      // Parse the line
-      face_t face;
-      sscanf(
-          line,
-          "f %d/%d/%d %d/%d/%d %d/%d/%d",
-          &face.a.position,
-          &face.a.texcoord,
-          &face.a.normal,
-          &face.b.position,
-          &face.b.texcoord,
-          &face.b.normal,
-          &face.c.position,
-          &face.c.texcoord,
-          &face.c.normal);
-
-      // Wavefront OBJ files index from one :(
-      face.a.position--;
-      face.a.texcoord--;
-      face.a.normal--;
-      face.b.position--;
-      face.b.texcoord--;
-      face.b.normal--;
-      face.c.position--;
-      face.c.texcoord--;
-      face.c.normal--;
-
-      // Store the parsed data
-      if (faces_size == faces_capacity) {
-        faces_capacity *= 2;
-        faces = realloc(faces, faces_capacity * sizeof(face_t));
-      }
-      faces[faces_size] = face;
-      faces_size++;
-    }
-  }
-
-  // Close model file
-  fclose(file);
+/** Reverse the order of the low bits of a Huffman code. Deflate packs bits from the least significant end, but codes from the most. */
+static uint32_t bits_reverse(uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < length; ++i) {
+    reversed = reversed << 1 | (code >> i & 1);
+  }
+  return reversed;
+}
 
-  // Load the head texture
-  image_t texture;
-  if (image_read(&texture, "data/african_head_diffuse.tga")) {
-    fprintf(stderr, "error: failed to read texture file\n");
-    exit(1);
+/** Fill in the lookup tables for writing PNG files. */
+static void png_tables_init(void) {
+  if (png_tables.ready) {
+    return;
   }
 
-  // Iterate over triangular faces in model
-  for (int i = 0; i < faces_size; ++i) {
-    face_t face = faces[i];
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; ++k) {
+      crc = crc & 1 ? 0xedb88320 ^ crc >> 1 : crc >> 1;
+    }
+    png_tables.crc[i] = crc;
+  }
 
-    // Look up vertex positions
-    vec3_t p1 = positions[face.a.position];
-    vec3_t p2 = positions[face.b.position];
-    vec3_t p3 = positions[face.c.position];
+  // The fixed codes are laid out in four runs (RFC 1951, section 3.2.6)
+  for (int symbol = 0; symbol < 288; ++symbol) {
+    uint32_t code;
+    int length;
+    if (symbol < 144) {
+      code = 0x30 + symbol;
+      length = 8;
+    } else if (symbol < 256) {
+      code = 0x190 + symbol - 144;
+      length = 9;
+    } else if (symbol < 280) {
+      code = symbol - 256;
+      length = 7;
+    } else {
+      code = 0xc0 + symbol - 280;
+      length = 8;
+    }
+    png_tables.codes[symbol] = (uint16_t) bits_reverse(code, length);
+    png_tables.code_lengths[symbol] = (uint8_t) length;
+  }
 
-    // Look up vertex texture coordinates
-    vec2_t tc1 = texcoords[face.a.texcoord];
-    vec2_t tc2 = texcoords[face.b.texcoord];
-    vec2_t tc3 = texcoords[face.c.texcoord];
+  for (int symbol = 0; symbol < 29; ++symbol) {
+    int last = symbol < 28 ? deflate_length_base[symbol + 1] - 1 : DEFLATE_MATCH_MAX;
+    for (int length = deflate_length_base[symbol]; length <= last; ++length) {
+      png_tables.length_symbols[length - DEFLATE_MATCH_MIN] = (uint8_t) symbol;
+    }
+  }
+  for (int symbol = 0; symbol < 30; ++symbol) {
+    int last = symbol < 29 ? deflate_distance_base[symbol + 1] - 1 : DEFLATE_WINDOW;
+    for (int distance = deflate_distance_base[symbol]; distance <= last; ++distance) {
+      png_tables.distance_symbols[distance <= 256 ? distance - 1 : 256 + ((distance - 1) >> 7)] = (uint8_t) symbol;
+    }
+  }
+
+  png_tables.ready = 1;
+}
+
+/** Continue a CRC-32 over more data. Start from zero. */
+static uint32_t png_crc(uint32_t crc, const uint8_t* data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = png_tables.crc[(crc ^ data[i]) & 0xff] ^ crc >> 8;
+  }
+  return ~crc;
+}
+
+/** Store a 32-bit value big-endian, the way PNG wants them. */
+static void png_put32(uint8_t* at, uint32_t value) {
+  at[0] = (uint8_t) (value >> 24);
+  at[1] = (uint8_t) (value >> 16);
+  at[2] = (uint8_t) (value >> 8);
+  at[3] = (uint8_t) value;
+}
+
+/** Write a PNG chunk to a file. */
+static int png_write_chunk(FILE* file, const char* type, const uint8_t* data, size_t size) {
+  uint8_t header[8];
+  uint8_t footer[4];
+  png_put32(header, (uint32_t) size);
+  memcpy(header + 4, type, 4);
+  png_put32(footer, png_crc(png_crc(0, header + 4, 4), data, size));
+  return fwrite(header, 1, 8, file) != 8 || (size && fwrite(data, 1, size, file) != size) || fwrite(footer, 1, 4, file) != 4;
+}
+
+/** A buffer that bits are packed into from the least significant end, the way deflate wants them. */
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  uint64_t bits;
+  int count;
+} bit_writer_t;
+
+/** Add up to 32 bits to a bit buffer. */
+FORCE_INLINE void bits_put(bit_writer_t* writer, uint32_t value, int count) {
+  writer->bits |= (uint64_t) value << writer->count;
+  writer->count += count;
+  if (writer->count >= 32) {
+    for (int i = 0; i < 4; ++i) {
+      writer->data[writer->size++] = (uint8_t) writer->bits;
+      writer->bits >>= 8;
+    }
+    writer->count -= 32;
+  }
+}
+
+/** Pad a bit buffer with zeros out to a whole byte, and write out everything in it. */
+static void bits_flush(bit_writer_t* writer) {
+  while (writer->count > 0) {
+    writer->data[writer->size++] = (uint8_t) writer->bits;
+    writer->bits >>= 8;
+    writer->count -= 8;
+  }
+  writer->bits = 0;
+  writer->count = 0;
+}
+
+/** Write a literal or length symbol in its fixed Huffman code. */
+FORCE_INLINE void deflate_put_symbol(bit_writer_t* writer, int symbol) {
+  bits_put(writer, png_tables.codes[symbol], png_tables.code_lengths[symbol]);
+}
+
+/** Hash the three bytes a match would start with. */
+FORCE_INLINE uint32_t deflate_hash(const uint8_t* data) {
+  uint32_t bytes = (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16;
+  return bytes * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+}
+
+/** Load eight bytes from anywhere. */
+FORCE_INLINE uint64_t deflate_load64(const uint8_t* data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+/** Longest run of candidates to try for a match, by compression level. */
+static const int deflate_chains[10] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+
+/**
+ * Compress data into deflate blocks.
+ *
+ * The blocks are never final, and finish with an empty stored block to end
+ * on a byte boundary (what zlib calls a sync flush). Matches never reach
+ * back before the start of the data. The output of several calls can
+ * therefore be joined into one stream and ended with a final empty block.
+ * Level zero stores the data as it is, and the rest use the fixed Huffman
+ * codes with longer searches for matches as the level goes up. The writer
+ * must have room for the data plus an eighth.
+ */
+static void deflate_blocks(bit_writer_t* writer, const uint8_t* data, size_t size, int level) {
+  if (level == 0) {
+    size_t at = 0;
+    do {
+      size_t length = min(size - at, 65535);
+      bits_put(writer, 0, 3);
+      bits_flush(writer);
+      writer->data[writer->size++] = (uint8_t) length;
+      writer->data[writer->size++] = (uint8_t) (length >> 8);
+      writer->data[writer->size++] = (uint8_t) ~length;
+      writer->data[writer->size++] = (uint8_t) (~length >> 8);
+      memcpy(writer->data + writer->size, data + at, length);
+      writer->size += length;
+      at += length;
+    } while (at < size);
+    return;
+  }
+
+  // Not final, fixed Huffman codes
+  bits_put(writer, 2, 3);
+
+  // The most recent position with each hash, and the position before each one with the same hash
+  int32_t* head = malloc(((size_t) 1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+  int32_t* previous = malloc(DEFLATE_WINDOW * sizeof(int32_t));
+  memset(head, 0xff, ((size_t) 1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+  int chain = deflate_chains[min(level, 9)];
+
+  size_t i = 0;
+  while (i < size) {
+    // Find the longest match in the window among the candidates with the same hash
+    int best = 0;
+    int best_distance = 0;
+    if (i + DEFLATE_MATCH_MIN <= size) {
+      int longest = (int) min(size - i, DEFLATE_MATCH_MAX);
+      uint32_t hash = deflate_hash(data + i);
+      int32_t candidate = head[hash];
+      for (int tries = chain; candidate >= 0 && i - candidate <= DEFLATE_WINDOW && tries > 0; --tries) {
+        // Only a match that gets past the best one so far can beat it
+        const uint8_t* a = data + candidate;
+        const uint8_t* b = data + i;
+        if (a[best] == b[best]) {
+          // Compare eight bytes at a time while they all match, then find where they stop
+          int length = 0;
+          while (length + 8 <= longest && deflate_load64(a + length) == deflate_load64(b + length)) {
+            length += 8;
+          }
+          while (length < longest && a[length] == b[length]) {
+            ++length;
+          }
+          if (length > best) {
+            best = length;
+            best_distance = (int) (i - candidate);
+            if (best == longest) {
+              break;
+            }
+          }
+        }
+        candidate = previous[candidate & (DEFLATE_WINDOW - 1)];
+      }
+      previous[i & (DEFLATE_WINDOW - 1)] = head[hash];
+      head[hash] = (int32_t) i;
+    }
+
+    if (best < DEFLATE_MATCH_MIN) {
+      deflate_put_symbol(writer, data[i]);
+      ++i;
+      continue;
+    }
+
+    int length_symbol = png_tables.length_symbols[best - DEFLATE_MATCH_MIN];
+    deflate_put_symbol(writer, 257 + length_symbol);
+    bits_put(writer, best - deflate_length_base[length_symbol], deflate_length_extra[length_symbol]);
+    int distance_symbol = png_tables.distance_symbols[best_distance <= 256 ? best_distance - 1 : 256 + ((best_distance - 1) >> 7)];
+    bits_put(writer, bits_reverse(distance_symbol, 5), 5);
+    bits_put(writer, best_distance - deflate_distance_base[distance_symbol], deflate_distance_extra[distance_symbol]);
+
+    // Remember the positions inside the match too, so later matches can start from them
+    for (size_t j = i + 1; j < i + best && j + DEFLATE_MATCH_MIN <= size; ++j) {
+      uint32_t hash = deflate_hash(data + j);
+      previous[j & (DEFLATE_WINDOW - 1)] = head[hash];
+      head[hash] = (int32_t) j;
+    }
+    i += best;
+  }
+
+  // End of block, then the empty stored block that brings it to a byte boundary
+  deflate_put_symbol(writer, 256);
+  bits_put(writer, 0, 3);
+  bits_flush(writer);
+  bits_put(writer, 0xffff0000, 32);
+
+  free(head);
+  free(previous);
+}
+
+/** Predict a byte from its neighbors to the left, above, and above left the way PNG's Paeth filter does. */
+static uint8_t png_paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return (uint8_t) a;
+  }
+  return (uint8_t) (pb <= pc ? b : c);
+}
+
+/** Filter a row of RGBA8 pixels with one of the five PNG filters. The row above is all zeros for the first row. */
+static void png_filter_row(uint8_t* out, const uint8_t* row, const uint8_t* above, size_t size, int filter) {
+  // The first pixel has nothing to its left, so it is as if that were zeros
+  const size_t left = sizeof(color_t);
+  switch (filter) {
+    case 0:
+      memcpy(out, row, size);
+      break;
+    case 1:
+      memcpy(out, row, left);
+      for (size_t i = left; i < size; ++i) {
+        out[i] = (uint8_t) (row[i] - row[i - left]);
+      }
+      break;
+    case 2:
+      for (size_t i = 0; i < size; ++i) {
+        out[i] = (uint8_t) (row[i] - above[i]);
+      }
+      break;
+    case 3:
+      for (size_t i = 0; i < left; ++i) {
+        out[i] = (uint8_t) (row[i] - (above[i] >> 1));
+      }
+      for (size_t i = left; i < size; ++i) {
+        out[i] = (uint8_t) (row[i] - ((row[i - left] + above[i]) >> 1));
+      }
+      break;
+    case 4:
+      for (size_t i = 0; i < left; ++i) {
+        out[i] = (uint8_t) (row[i] - above[i]);
+      }
+      for (size_t i = left; i < size; ++i) {
+        out[i] = (uint8_t) (row[i] - png_paeth(row[i - left], above[i], above[i - left]));
+      }
+      break;
+  }
+}
+
+/** Where a QOI encoder is in the stream. */
+typedef struct {
+  /** Recently seen colors, by hash. */
+  color_t index[64];
+
+  color_t previous;
+
+  /** How many pixels in a row have repeated the previous one. */
+  int run;
+} qoi_state_t;
+
+/** Encode pixels as QOI chunks, continuing from a state. Each pixel takes at most five bytes. Returns the number of bytes written. */
+static size_t qoi_encode(qoi_state_t* state, const color_t* pixels, size_t count, uint8_t* out) {
+  uint8_t* at = out;
+  for (size_t i = 0; i < count; ++i) {
+    color_t pixel = pixels[i];
+
+    // Repeats just count up, to as many as a run can hold
+    if (pixel.value == state->previous.value) {
+      if (++state->run == 62) {
+        *at++ = (uint8_t) (0xc0 | (state->run - 1));
+        state->run = 0;
+      }
+      continue;
+    }
+    if (state->run > 0) {
+      *at++ = (uint8_t) (0xc0 | (state->run - 1));
+      state->run = 0;
+    }
+
+    // A color seen recently takes one byte
+    int hash = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+    if (state->index[hash].value == pixel.value) {
+      *at++ = (uint8_t) hash;
+    } else {
+      state->index[hash] = pixel;
+
+      // Otherwise, the smallest difference from the previous color that fits
+      if (pixel.a == state->previous.a) {
+        int8_t dr = (int8_t) (pixel.r - state->previous.r);
+        int8_t dg = (int8_t) (pixel.g - state->previous.g);
+        int8_t db = (int8_t) (pixel.b - state->previous.b);
+        int8_t dr_dg = (int8_t) (dr - dg);
+        int8_t db_dg = (int8_t) (db - dg);
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          *at++ = (uint8_t) (0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+          *at++ = (uint8_t) (0x80 | (dg + 32));
+          *at++ = (uint8_t) ((dr_dg + 8) << 4 | (db_dg + 8));
+        } else {
+          *at++ = 0xfe;
+          *at++ = pixel.r;
+          *at++ = pixel.g;
+          *at++ = pixel.b;
+        }
+      } else {
+        *at++ = 0xff;
+        *at++ = pixel.r;
+        *at++ = pixel.g;
+        *at++ = pixel.b;
+        *at++ = pixel.a;
+      }
+    }
+    state->previous = pixel;
+  }
+  return (size_t) (at - out);
+}
+
+typedef struct image_stream image_stream_t;
+
+/** How to write one output format. */
+typedef struct {
+  const char* extension;
+
+  /** Write what comes before the pixels, or NULL for nothing. */
+  int (*begin)(image_stream_t* stream);
+
+  /**
+   * Encode a band of rows, returning a buffer to write out and free.
+   *
+   * Bands are encoded on any thread in any order, unless ordered is set.
+   * Then they are encoded one after another, in order, with the stream
+   * locked.
+   */
+  uint8_t* (*encode)(image_stream_t* stream, int band, size_t* size);
+  int ordered;
+
+  /** Write what comes after the pixels, or NULL for nothing. */
+  int (*end)(image_stream_t* stream);
+} image_writer_t;
+
+/** Where a band of an image stream is at. */
+typedef enum {
+  BAND_WAITING,
+  BAND_ENCODING,
+  BAND_ENCODED,
+  BAND_WRITTEN,
+} band_state_t;
+
+/**
+ * An image being written to a file a band of rows at a time.
+ *
+ * Bands can be handed in as soon as their pixels are final, from any
+ * thread and in any order. Each one is encoded right away on the thread
+ * that hands it in, and held until every band above it has gone to the
+ * file. Nothing ever needs the whole image at once.
+ */
+struct image_stream {
+  const image_t* image;
+  const image_writer_t* writer;
+  FILE* file;
+  int band_rows;
+  int bands;
+
+  pthread_mutex_t lock;
+  band_state_t* states;
+
+  // Encoded bands waiting for the ones before them
+  uint8_t** chunks;
+  size_t* chunk_sizes;
+
+  // The next band to go to the file
+  int next;
+  int error;
+
+  // Threads encoding what is left when the stream is closed
+  int workers;
+
+  // For PNG, the Adler-32 and length of each band's share of the zlib stream
+  uint32_t* adlers;
+  size_t* sizes;
+
+  qoi_state_t qoi;
+};
+
+/** Get the first row of a band and the row past its last. */
+static void image_stream_rows(const image_stream_t* stream, int band, int* y1, int* y2) {
+  *y1 = band * stream->band_rows;
+  *y2 = min(*y1 + stream->band_rows, stream->image->height);
+}
+
+/** Put a band of an image in order. The caller frees the result. */
+static color_t* image_stream_pixels(const image_stream_t* stream, int band, size_t* count) {
+  int y1;
+  int y2;
+  image_stream_rows(stream, band, &y1, &y2);
+  *count = (size_t) (y2 - y1) * stream->image->width;
+  color_t* pixels = malloc(*count * sizeof(color_t));
+  image_copy_rows(stream->image, y1, y2, pixels);
+  return pixels;
+}
+
+/** Start a PNG file: the signature, then the header. */
+static int png_begin(image_stream_t* stream) {
+  png_tables_init();
+
+  // Eight-bit RGBA, not interlaced
+  uint8_t header[13] = {0};
+  png_put32(header, (uint32_t) stream->image->width);
+  png_put32(header + 4, (uint32_t) stream->image->height);
+  header[8] = 8;
+  header[9] = 6;
+
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  return fwrite(signature, 1, sizeof(signature), stream->file) != sizeof(signature) || png_write_chunk(stream->file, "IHDR", header, sizeof(header));
+}
+
+/**
+ * Filter and compress a band of rows into an IDAT chunk of its own.
+ *
+ * The chunks of all the bands together make up one zlib stream. The first
+ * row of a band is only filtered in ways that leave the row above alone,
+ * which may not be final yet.
+ */
+static uint8_t* png_encode(image_stream_t* stream, int band, size_t* chunk_size) {
+  size_t count;
+  color_t* pixels = image_stream_pixels(stream, band, &count);
+  size_t row_size = (size_t) stream->image->width * sizeof(color_t);
+  size_t rows = count * sizeof(color_t) / row_size;
+  size_t size = (row_size + 1) * rows;
+
+  // Filter each row the way that leaves the smallest sum of differences, which tends to compress best
+  uint8_t* filtered = malloc(size);
+  uint8_t* scratch = malloc(row_size * 2);
+  for (size_t y = 0; y < rows; ++y) {
+    const uint8_t* row = (const uint8_t*) pixels + y * row_size;
+    const uint8_t* above = y > 0 ? row - row_size : NULL;
+    uint8_t* out = filtered + (row_size + 1) * y;
+    uint8_t* best = NULL;
+    long best_sum = 0;
+    for (int filter = 0; filter < (y > 0 ? 5 : 2); ++filter) {
+      // Filter into whichever half of the scratch space does not hold the best so far
+      uint8_t* candidate = best == scratch ? scratch + row_size : scratch;
+      png_filter_row(candidate, row, above, row_size, filter);
+      long sum = 0;
+      for (size_t i = 0; i < row_size; ++i) {
+        sum += abs((int8_t) candidate[i]);
+      }
+      if (!best || sum < best_sum) {
+        best = candidate;
+        best_sum = sum;
+        out[0] = (uint8_t) filter;
+      }
+    }
+    memcpy(out + 1, best, row_size);
+  }
+  free(scratch);
+  free(pixels);
+
+  // The zlib stream wants an Adler-32 of everything, which is put together from the bands at the end
+  uint32_t s1 = 1;
+  uint32_t s2 = 0;
+  for (size_t i = 0; i < size;) {
+    // This many bytes cannot overflow the sums before they are reduced
+    size_t end = min(size, i + 5552);
+    for (; i < end; ++i) {
+      s1 += filtered[i];
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  stream->adlers[band] = s2 << 16 | s1;
+  stream->sizes[band] = size;
+
+  // Compress into a chunk, leaving room for its length and type up front
+  // The first band starts the zlib stream with its header: deflate with a 32K window, at some compression level
+  bit_writer_t writer = {
+    .data = malloc(size + size / 8 + 5 * (size / 65535 + 1) + 64),
+    .size = 8,
+  };
+  if (band == 0) {
+    writer.data[writer.size++] = 0x78;
+    writer.data[writer.size++] = 0x01;
+  }
+  deflate_blocks(&writer, filtered, size, options.png_level);
+  free(filtered);
+
+  png_put32(writer.data, (uint32_t) (writer.size - 8));
+  memcpy(writer.data + 4, "IDAT", 4);
+  png_put32(writer.data + writer.size, png_crc(0, writer.data + 4, writer.size - 4));
+  *chunk_size = writer.size + 4;
+  return writer.data;
+}
+
+/** Finish a PNG file: end the zlib stream with a final, empty stored block and the checksum in one last, tiny chunk. */
+static int png_end(image_stream_t* stream) {
+  // Put the Adler-32 of the whole stream together from the bands
+  // For a band of n bytes, the first sum adds on and the second adds on plus n times the first sum so far
+  uint32_t s1 = 1;
+  uint32_t s2 = 0;
+  for (int i = 0; i < stream->bands; ++i) {
+    uint32_t band_s1 = stream->adlers[i] & 0xffff;
+    uint32_t band_s2 = stream->adlers[i] >> 16;
+    uint32_t n = (uint32_t) (stream->sizes[i] % 65521);
+    s2 = (uint32_t) ((s2 + band_s2 + (uint64_t) n * (s1 + 65521 - 1)) % 65521);
+    s1 = (s1 + band_s1 + 65521 - 1) % 65521;
+  }
+
+  uint8_t end[9] = {0x01, 0x00, 0x00, 0xff, 0xff};
+  png_put32(end + 5, s2 << 16 | s1);
+  return png_write_chunk(stream->file, "IDAT", end, sizeof(end)) || png_write_chunk(stream->file, "IEND", NULL, 0);
+}
+
+/** Encode a band as raw RGBA8 rows, which is just putting it in order. */
+static uint8_t* raw_encode(image_stream_t* stream, int band, size_t* size) {
+  size_t count;
+  color_t* pixels = image_stream_pixels(stream, band, &count);
+  *size = count * sizeof(color_t);
+  return (uint8_t*) pixels;
+}
+
+/** Start a binary PPM file. */
+static int ppm_begin(image_stream_t* stream) {
+  return fprintf(stream->file, "P6\n%d %d\n255\n", stream->image->width, stream->image->height) < 0;
+}
+
+/** Encode a band as RGB8 rows, dropping alpha. */
+static uint8_t* ppm_encode(image_stream_t* stream, int band, size_t* size) {
+  size_t count;
+  color_t* pixels = image_stream_pixels(stream, band, &count);
+  uint8_t* out = malloc(count * 3);
+  for (size_t i = 0; i < count; ++i) {
+    out[i * 3] = pixels[i].r;
+    out[i * 3 + 1] = pixels[i].g;
+    out[i * 3 + 2] = pixels[i].b;
+  }
+  free(pixels);
+  *size = count * 3;
+  return out;
+}
+
+/** Start a QOI file. */
+static int qoi_begin(image_stream_t* stream) {
+  // Magic, size, four channels, sRGB with linear alpha
+  uint8_t header[14] = {'q', 'o', 'i', 'f'};
+  png_put32(header + 4, (uint32_t) stream->image->width);
+  png_put32(header + 8, (uint32_t) stream->image->height);
+  header[12] = 4;
+  header[13] = 0;
+
+  qoi_state_t start = {
+    .previous = {.a = 255},
+  };
+  stream->qoi = start;
+  return fwrite(header, 1, sizeof(header), stream->file) != sizeof(header);
+}
+
+/** Encode a band as QOI chunks. Each continues from the state the band above left, so they go in order. */
+static uint8_t* qoi_encode_band(image_stream_t* stream, int band, size_t* size) {
+  size_t count;
+  color_t* pixels = image_stream_pixels(stream, band, &count);
+  uint8_t* out = malloc(count * 5 + 1);
+  *size = qoi_encode(&stream->qoi, pixels, count, out);
+  free(pixels);
+  return out;
+}
+
+/** Finish a QOI file: any run still going, then the end marker. */
+static int qoi_end(image_stream_t* stream) {
+  uint8_t end[9] = {0, 0, 0, 0, 0, 0, 0, 0, 1};
+  size_t start = 1;
+  if (stream->qoi.run > 0) {
+    end[0] = (uint8_t) (0xc0 | (stream->qoi.run - 1));
+    start = 0;
+  }
+  return fwrite(end + start, 1, sizeof(end) - start, stream->file) != sizeof(end) - start;
+}
+
+/** The writer for each output format. */
+static const image_writer_t image_writers[] = {
+  [OUTPUT_PNG] = {"png", png_begin, png_encode, 0, png_end},
+  [OUTPUT_RAW] = {"raw", NULL, raw_encode, 0, NULL},
+  [OUTPUT_PPM] = {"ppm", ppm_begin, ppm_encode, 0, NULL},
+  [OUTPUT_QOI] = {"qoi", qoi_begin, qoi_encode_band, 1, qoi_end},
+};
+
+/** Start writing an image to a file in some format, in bands of some number of rows. The format's extension is added to the name. */
+static int image_stream_open(image_stream_t* stream, const image_t* image, const char* name, output_format_t format, int band_rows) {
+  char filename[256];
+  snprintf(filename, sizeof(filename), "%s.%s", name, image_writers[format].extension);
+  FILE* file = fopen(filename, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  stream->image = image;
+  stream->writer = &image_writers[format];
+  stream->file = file;
+  stream->band_rows = band_rows;
+  stream->bands = (image->height + band_rows - 1) / band_rows;
+  pthread_mutex_init(&stream->lock, NULL);
+  stream->states = calloc(stream->bands, sizeof(band_state_t));
+  stream->chunks = calloc(stream->bands, sizeof(uint8_t*));
+  stream->chunk_sizes = calloc(stream->bands, sizeof(size_t));
+  stream->next = 0;
+  stream->error = 0;
+  stream->adlers = calloc(stream->bands, sizeof(uint32_t));
+  stream->sizes = calloc(stream->bands, sizeof(size_t));
+  if (stream->writer->begin) {
+    stream->error = stream->writer->begin(stream);
+  }
+  return 0;
+}
+
+/** Hand in a band whose pixels are final. It is encoded, and written out along with any bands below it that were only waiting for it. Safe to call from any thread, and more than once. */
+static void image_stream_band(image_stream_t* stream, int band) {
+  // Claim the band, so that it is only encoded once
+  pthread_mutex_lock(&stream->lock);
+  if (stream->states[band] != BAND_WAITING) {
+    pthread_mutex_unlock(&stream->lock);
+    return;
+  }
+  stream->states[band] = BAND_ENCODING;
+  pthread_mutex_unlock(&stream->lock);
+
+  uint8_t* chunk = NULL;
+  size_t size = 0;
+  if (!stream->writer->ordered) {
+    chunk = stream->writer->encode(stream, band, &size);
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  stream->chunks[band] = chunk;
+  stream->chunk_sizes[band] = size;
+  stream->states[band] = BAND_ENCODED;
+
+  // Write out every band from the next one on that is ready
+  while (stream->next < stream->bands && stream->states[stream->next] == BAND_ENCODED) {
+    int next = stream->next;
+    if (stream->writer->ordered) {
+      stream->chunks[next] = stream->writer->encode(stream, next, &stream->chunk_sizes[next]);
+    }
+    stream->error |= fwrite(stream->chunks[next], 1, stream->chunk_sizes[next], stream->file) != stream->chunk_sizes[next];
+    free(stream->chunks[next]);
+    stream->chunks[next] = NULL;
+    stream->states[next] = BAND_WRITTEN;
+    stream->next++;
+  }
+  pthread_mutex_unlock(&stream->lock);
+}
+
+/** Hand in the bands for one encoding thread. Threads take every so many, so they move down the image together. */
+static void image_stream_worker(void* arg, int index) {
+  image_stream_t* stream = arg;
+  for (int band = index; band < stream->bands; band += stream->workers) {
+    image_stream_band(stream, band);
+  }
+}
+
+/** Finish writing an image. Any bands not handed in yet are encoded here, split between threads. Returns nonzero if anything failed. */
+static int image_stream_close(image_stream_t* stream) {
+  if (stream->next < stream->bands) {
+    stream->workers = min(options.png_threads > 0 ? options.png_threads : thread_count(), stream->bands);
+    parallel_run(stream->workers, image_stream_worker, stream);
+  }
+
+  int error = stream->error;
+  if (stream->writer->end) {
+    error |= stream->writer->end(stream);
+  }
+  error |= fclose(stream->file) != 0;
+
+  pthread_mutex_destroy(&stream->lock);
+  free(stream->states);
+  free(stream->chunks);
+  free(stream->chunk_sizes);
+  free(stream->adlers);
+  free(stream->sizes);
+  return error ? -1 : 0;
+}
+
+/** Number of color buffers to render with. The writer can work on one while the next frame is drawn into another. */
+#define OUTPUT_BUFFERS 2
+
+/** A frame in a color buffer, and the stream it is written out through. */
+typedef struct {
+  image_t* image;
+  image_stream_t* stream;
+  int number;
+} frame_t;
+
+/**
+ * A bounded queue of frames between threads.
+ *
+ * Pushing waits while the queue is full and popping waits while it is
+ * empty, so whichever side gets ahead is held back by the other.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  frame_t frames[OUTPUT_BUFFERS];
+  int head;
+  int size;
+
+  /** Set once nothing more will be pushed. */
+  int closed;
+} frame_queue_t;
+
+/** Set up an empty frame queue. */
+static void frame_queue_init(frame_queue_t* queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+  queue->head = 0;
+  queue->size = 0;
+  queue->closed = 0;
+}
+
+/** Tear down a frame queue. */
+static void frame_queue_destroy(frame_queue_t* queue) {
+  pthread_cond_destroy(&queue->changed);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+/** Add a frame to the tail of a queue, waiting for room if it is full. */
+static void frame_queue_push(frame_queue_t* queue, frame_t frame) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == OUTPUT_BUFFERS) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  queue->frames[(queue->head + queue->size++) % OUTPUT_BUFFERS] = frame;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/** Take a frame from the head of a queue, waiting for one if it is empty. Returns -1 once it is closed and empty. */
+static int frame_queue_pop(frame_queue_t* queue, frame_t* frame) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  int result = -1;
+  if (queue->size > 0) {
+    *frame = queue->frames[queue->head];
+    queue->head = (queue->head + 1) % OUTPUT_BUFFERS;
+    queue->size--;
+    pthread_cond_broadcast(&queue->changed);
+    result = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return result;
+}
+
+/** Mark a queue as getting nothing more, which lets whoever pops from it finish. */
+static void frame_queue_close(frame_queue_t* queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/** A thread that writes out finished frames. */
+typedef struct {
+  /** Frames to write, and where to hand their buffers back once they are written. */
+  frame_queue_t* finished;
+  frame_queue_t* free;
+
+  /** Set if any frame failed to write. */
+  int error;
+} writer_t;
+
+/** Entry point for the writer thread. */
+static void* writer_thread(void* arg) {
+  writer_t* writer = arg;
+
+  frame_t frame;
+  while (!frame_queue_pop(writer->finished, &frame)) {
+    // Whatever the renderer did not already send out goes now
+    if (image_stream_close(frame.stream)) {
+      fprintf(stderr, "error: failed to save frame %d\n", frame.number);
+      writer->error = 1;
+    }
+    frame_queue_push(writer->free, frame);
+  }
+  return NULL;
+}
+
+/**
+ * A depth buffer.
+ *
+ * Depth runs from zero at the far plane up to depth_max() at the near
+ * plane, so nearer is greater and a buffer of zero bits is clear in every
+ * format. Code that touches depth per pixel takes the format as a constant
+ * argument and is inlined once per format, so it never branches on it.
+ * Like color, depth is stored in swizzled tiles, and cleared lazily.
+ */
+typedef struct {
+  int width;
+  int height;
+  depth_format_t format;
+  void* data;
+
+  // One flag per tile that has yet to be cleared
+  uint8_t* pending;
+
+  // Which triangle wrote each depth, stored like the depth, when shading is deferred
+  // Two triangles can round to the same depth, and this lets the shading pass pick the one the depth pass kept
+  uint32_t* owners;
+} depth_buffer_t;
+
+/** Get the size of a depth value in bytes. */
+static size_t depth_size(depth_format_t format) {
+  return format == DEPTH_D16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+/** Get the depth of the near plane. */
+static float depth_max(depth_format_t format) {
+  switch (format) {
+    case DEPTH_D16:
+      return 65535.0f;
+    case DEPTH_D24:
+      return 16777215.0f;
+    case DEPTH_D32F:
+      break;
+  }
+  return 1.0f;
+}
+
+/** Allocate a depth buffer. */
+static void depth_buffer_alloc(depth_buffer_t* buffer, int width, int height, depth_format_t format) {
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = format;
+  buffer->data = malloc(swizzle_size(width, height) * depth_size(format));
+  buffer->pending = malloc(swizzle_tiles(width) * swizzle_tiles(height));
+  buffer->owners = NULL;
+}
+
+/** Clear a depth buffer to the far plane. Like image_clear(), this only marks the tiles. */
+static void depth_buffer_clear(depth_buffer_t* buffer) {
+  memset(buffer->pending, 1, swizzle_tiles(buffer->width) * swizzle_tiles(buffer->height));
+}
+
+/** Check whether the swizzled tile holding pixel (x, y) is still waiting to be cleared, and so is all far. */
+FORCE_INLINE int depth_pending(const depth_buffer_t* buffer, int x, int y) {
+  return buffer->pending[swizzle_tile(x, y, buffer->width)];
+}
+
+/** Clear the swizzled tile holding pixel (x, y), if that is still pending. */
+FORCE_INLINE void depth_materialize(depth_buffer_t* buffer, int x, int y) {
+  size_t tile = swizzle_tile(x, y, buffer->width);
+  if (buffer->pending[tile]) {
+    size_t size = SWIZZLE_SIZE * SWIZZLE_SIZE * depth_size(buffer->format);
+    memset((char*) buffer->data + tile * size, 0, size);
+
+    // The owners go with the depth, so that a triangle from an earlier frame cannot claim a pixel nobody drew yet
+    // Every bit set is no triangle at all
+    if (buffer->owners) {
+      memset(buffer->owners + tile * SWIZZLE_SIZE * SWIZZLE_SIZE, 0xff, SWIZZLE_SIZE * SWIZZLE_SIZE * sizeof(uint32_t));
+    }
+    buffer->pending[tile] = 0;
+  }
+}
+
+/** Access the triangle that wrote a depth value. Only deferred shading keeps track. */
+#define depth_owner(buffer, x, y) \
+    ((buffer)->owners[swizzle_index((x), (y), (buffer)->width)])
+
+/** Get the address of a depth value. */
+FORCE_INLINE void* depth_address(const depth_buffer_t* buffer, int x, int y, depth_format_t format) {
+  return (char*) buffer->data + swizzle_index(x, y, buffer->width) * depth_size(format);
+}
+
+/** Round an interpolated depth to what the format can store. */
+FORCE_INLINE float depth_quantize(float depth, depth_format_t format) {
+  if (format == DEPTH_D32F) {
+    return depth;
+  }
+
+  // Interpolation can overshoot the vertices a little, and the model need not stay between the planes
+  return (float) (int32_t) min(max(depth, 0.0f), depth_max(format));
+}
+
+/** Read a depth value. */
+FORCE_INLINE float depth_read(const depth_buffer_t* buffer, int x, int y, depth_format_t format) {
+  const void* at = depth_address(buffer, x, y, format);
+  switch (format) {
+    case DEPTH_D16:
+      return *(const uint16_t*) at;
+    case DEPTH_D24:
+      return (float) *(const uint32_t*) at;
+    case DEPTH_D32F:
+      break;
+  }
+  return *(const float*) at;
+}
+
+/** Write a depth value that has already been quantized. */
+FORCE_INLINE void depth_write(depth_buffer_t* buffer, int x, int y, float depth, depth_format_t format) {
+  void* at = depth_address(buffer, x, y, format);
+  switch (format) {
+    case DEPTH_D16:
+      *(uint16_t*) at = (uint16_t) depth;
+      return;
+    case DEPTH_D24:
+      *(uint32_t*) at = (uint32_t) depth;
+      return;
+    case DEPTH_D32F:
+      break;
+  }
+  *(float*) at = depth;
+}
+
+/** Get the render targets ready to draw to in [x1, x2] x [y1, y2], carrying out any clears still pending there. */
+static void targets_materialize(image_t* o_color, depth_buffer_t* o_depth, int x1, int y1, int x2, int y2) {
+  for (int y = y1 & ~(SWIZZLE_SIZE - 1); y <= y2; y += SWIZZLE_SIZE) {
+    for (int x = x1 & ~(SWIZZLE_SIZE - 1); x <= x2; x += SWIZZLE_SIZE) {
+      image_materialize(o_color, x, y);
+      depth_materialize(o_depth, x, y);
+    }
+  }
+}
+
+/** 2D vector. */
+typedef struct {
+  float x;
+  float y;
+} vec2_t;
+
+/** 3D vector. */
+typedef struct {
+  float x;
+  float y;
+  float z;
+} vec3_t;
+
+/** Dot product between two 3-vectors. */
+inline static float dot3(vec3_t a, vec3_t b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+/** Cross product between two 3-vectors. */
+inline static vec3_t cross3(vec3_t a, vec3_t b) {
+  return (vec3_t) {
+    .x = a.y * b.z - a.z * b.y,
+    .y = a.z * b.x - a.x * b.z,
+    .z = a.x * b.y - a.y * b.x,
+  };
+}
+
+/** Normalize a 3-vector. */
+inline static vec3_t norm3(vec3_t v) {
+  float mag = sqrtf(dot3(v, v));
+  return (vec3_t) {
+    .x = v.x / mag,
+    .y = v.y / mag,
+    .z = v.z / mag,
+  };
+}
+
+/** A function linear over the screen. */
+typedef struct {
+  float dx;
+  float dy;
+  float c;
+} plane_t;
+
+/** Evaluate a plane at a point. */
+inline static float plane_at(plane_t p, float x, float y) {
+  return p.c + p.dx * x + p.dy * y;
+}
+
+/** Build the plane of an attribute given its value at each vertex and the barycentric planes. */
+inline static plane_t plane_lerp(const plane_t bary[3], float a, float b, float c) {
+  return (plane_t) {
+    .dx = a * bary[0].dx + b * bary[1].dx + c * bary[2].dx,
+    .dy = a * bary[0].dy + b * bary[1].dy + c * bary[2].dy,
+    .c = a * bary[0].c + b * bary[1].c + c * bary[2].c,
+  };
+}
+
+/** Fractional bits in fixed-point screen positions. */
+#define SUBPIXEL_BITS 8
+
+/** One pixel in fixed point. */
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+
+/**
+ * How far off the screen, in pixels, a vertex may be and still be rasterized.
+ *
+ * This keeps edge functions within 64 bits. There is no clipper, so
+ * triangles reaching farther than this are dropped.
+ */
+#define GUARD_BAND 16384
+
+/**
+ * An edge function in fixed point, stepped exactly from pixel to pixel.
+ *
+ * It is positive on the inside of the edge. Pixels exactly on the edge
+ * count as inside only for top and left edges, which is folded into c, so
+ * a pixel is inside the edge when the function is nonnegative.
+ */
+typedef struct {
+  int64_t dx;
+  int64_t dy;
+  int64_t c;
+} edge_t;
+
+/** Evaluate an edge function at a pixel. */
+inline static int64_t edge_at(edge_t e, int x, int y) {
+  return e.c + e.dx * x + e.dy * y;
+}
+
+/** A triangle that has been set up for rasterization. */
+typedef struct {
+  // Inclusive pixel bounds
+  int x1;
+  int y1;
+  int x2;
+  int y2;
+
+  // Edge functions: a pixel is inside when all three are nonnegative
+  edge_t edges[3];
+
+  // Barycentric coordinates (u, v, w), for interpolation
+  plane_t bary[3];
+
+  // Interpolated depth, and the nearest depth anywhere on the triangle
+  plane_t z;
+  float z_max;
+
+  // Interpolated texture coordinates, and the mip level to sample them from
+  plane_t tx;
+  plane_t ty;
+  float lod;
+
+  // Interpolated normal Z, which is all a lamp straight down the Z-axis needs
+  plane_t nz;
+
+  // Index of the triangle in the geometry it came from
+  int triangle;
+} setup_t;
+
+/** What became of a triangle in setup. */
+typedef enum {
+  /** It is ready to be drawn. */
+  SETUP_DRAWN,
+
+  /** It faces away from the camera. */
+  SETUP_BACK_FACING,
+
+  /** It has no area. */
+  SETUP_DEGENERATE,
+
+  /** It is entirely outside the screen. */
+  SETUP_OFF_SCREEN,
+
+  /** It reaches past the guard band. */
+  SETUP_GUARD_BAND,
+
+  /** It is on the screen, but covers no pixel. */
+  SETUP_EMPTY,
+} setup_result_t;
+
+/** Set up the edge function of the edge from p to q, given in fixed point. */
+static edge_t edge_setup(int64_t px, int64_t py, int64_t qx, int64_t qy) {
+  // Sample points sit on whole pixels, so pixel (x, y) is at (x, y) * SUBPIXEL_ONE in fixed point
+  // There, the function is (q - p) x (sample - p)
+  return (edge_t) {
+    .dx = -(qy - py) * SUBPIXEL_ONE,
+    .dy = (qx - px) * SUBPIXEL_ONE,
+    .c = (qy - py) * px - (qx - px) * py,
+  };
+}
+
+/** Set up a triangle for rasterization, unless it can be culled outright. */
+static setup_result_t triangle_setup(setup_t* s, const image_t* o_color, vec3_t a, vec2_t at, vec3_t an, vec3_t b, vec2_t bt, vec3_t bn, vec3_t c, vec2_t ct, vec3_t cn) {
+  // Opposite corners of bounding box wrapping the triangle
+  vec2_t aabb1 = {
+    .x = min(a.x, min(b.x, c.x)),
+    .y = min(a.y, min(b.y, c.y)),
+  };
+  vec2_t aabb2 = {
+    .x = max(a.x, max(b.x, c.x)),
+    .y = max(a.y, max(b.y, c.y)),
+  };
+
+  // Drop triangles that miss the screen entirely
+  if (aabb2.x < 0 || aabb2.y < 0 || aabb1.x >= (float) o_color->width || aabb1.y >= (float) o_color->height) {
+    return SETUP_OFF_SCREEN;
+  }
+
+  // The edge functions only fit in 64 bits for vertices near enough the screen (this also catches NaN)
+  if (!(aabb1.x >= -GUARD_BAND && aabb1.y >= -GUARD_BAND && aabb2.x <= GUARD_BAND && aabb2.y <= GUARD_BAND)) {
+    return SETUP_GUARD_BAND;
+  }
+
+  // Snap the vertices to the subpixel grid
+  // Everything from here on works from the snapped positions, so coverage and interpolation agree
+  int64_t ax = lrintf(a.x * SUBPIXEL_ONE);
+  int64_t ay = lrintf(a.y * SUBPIXEL_ONE);
+  int64_t bx = lrintf(b.x * SUBPIXEL_ONE);
+  int64_t by = lrintf(b.y * SUBPIXEL_ONE);
+  int64_t cx = lrintf(c.x * SUBPIXEL_ONE);
+  int64_t cy = lrintf(c.y * SUBPIXEL_ONE);
+
+  // Twice the signed area, exactly
+  int64_t area = (bx - ax) * (cy - ay) - (cx - ax) * (by - ay);
+
+  // Faces wind counterclockwise when seen from the front, which the flip of the Y-axis onto the screen turns clockwise
+  // Nothing is lost by dropping the back faces of a closed model, since front faces always hide them
+  if (options.cull && area > 0) {
+    return SETUP_BACK_FACING;
+  }
+
+  // Zero area means there is nothing to draw
+  if (area == 0) {
+    return SETUP_DEGENERATE;
+  }
+
+  // Pixels sampled by the snapped triangle, clipped at the color buffer boundaries
+  // The first is the first whole pixel at or after the left edge, and the last the last one at or before the right
+  s->x1 = (int) ((max(0, min(ax, min(bx, cx))) + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+  s->y1 = (int) ((max(0, min(ay, min(by, cy))) + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+  s->x2 = min(o_color->width - 1, (int) (max(ax, max(bx, cx)) >> SUBPIXEL_BITS));
+  s->y2 = min(o_color->height - 1, (int) (max(ay, max(by, cy)) >> SUBPIXEL_BITS));
+  if (s->x1 > s->x2 || s->y1 > s->y2) {
+    return SETUP_EMPTY;
+  }
+
+  // Edges opposite A, B and C, facing inward whichever way the triangle winds
+  s->edges[0] = edge_setup(bx, by, cx, cy);
+  s->edges[1] = edge_setup(cx, cy, ax, ay);
+  s->edges[2] = edge_setup(ax, ay, bx, by);
+  for (int i = 0; i < 3; ++i) {
+    edge_t* e = &s->edges[i];
+    if (area < 0) {
+      *e = (edge_t) {
+        .dx = -e->dx,
+        .dy = -e->dy,
+        .c = -e->c,
+      };
+    }
+
+    // Top-left fill rule: a pixel exactly on an edge belongs to the triangle only if the edge is a left edge
+    // (inside lies to its right) or a top edge (flat, with inside below, since Y points down)
+    // Any two triangles sharing an edge see it from opposite sides, so exactly one of them gets the pixel
+    if (!(e->dx > 0 || (e->dx == 0 && e->dy > 0))) {
+      e->c -= 1;
+    }
+  }
+
+  // The snapped positions, for the floating point setup below
+  a.x = (float) ax / SUBPIXEL_ONE;
+  a.y = (float) ay / SUBPIXEL_ONE;
+  b.x = (float) bx / SUBPIXEL_ONE;
+  b.y = (float) by / SUBPIXEL_ONE;
+  c.x = (float) cx / SUBPIXEL_ONE;
+  c.y = (float) cy / SUBPIXEL_ONE;
+
+  // The vector AB
+  vec2_t ab = {
+    .x = b.x - a.x,
+    .y = b.y - a.y,
+  };
+
+  // The vector AC
+  vec2_t ac = {
+    .x = c.x - a.x,
+    .y = c.y - a.y,
+  };
+
+  // The common denominator from Cramer's rule (twice the signed area)
+  // This is constant over the triangle, so we only ever divide by it here
+  // Taking it from the exact area keeps slivers from cancelling out to zero
+  float inverse = (float) (SUBPIXEL_ONE * SUBPIXEL_ONE) / (float) area;
+
+  // Solve for v and w as linear functions of the pixel position
+  // With AP = P - A, v = (AP x AC) / den and w = (AB x AP) / den
+  s->bary[1] = (plane_t) {
+    .dx = ac.y * inverse,
+    .dy = -ac.x * inverse,
+    .c = (ac.x * a.y - a.x * ac.y) * inverse,
+  };
+  s->bary[2] = (plane_t) {
+    .dx = -ab.y * inverse,
+    .dy = ab.x * inverse,
+    .c = (a.x * ab.y - ab.x * a.y) * inverse,
+  };
+
+  // And u = 1 - v - w
+  s->bary[0] = (plane_t) {
+    .dx = -s->bary[1].dx - s->bary[2].dx,
+    .dy = -s->bary[1].dy - s->bary[2].dy,
+    .c = 1.0f - s->bary[1].c - s->bary[2].c,
+  };
+
+  // Every attribute is a blend of the vertex values, so it is a plane too
+  s->z = plane_lerp(s->bary, a.z, b.z, c.z);
+  s->z_max = max(a.z, max(b.z, c.z));
+  s->tx = plane_lerp(s->bary, at.x, bt.x, ct.x);
+  s->ty = plane_lerp(s->bary, at.y, bt.y, ct.y);
+  s->nz = plane_lerp(s->bary, an.z, bn.z, cn.z);
+
+  return SETUP_DRAWN;
+}
+
+/** What a span does with the pixels it covers. */
+typedef enum {
+  /** Shade the pixels that pass the depth test, and write color and depth. */
+  PASS_FORWARD,
+
+  /** Write depth, and which triangle it came from, where it passes the depth test, leaving shading for later. */
+  PASS_DEPTH,
+
+  /** Shade the pixels the depth pass left to this triangle, and write color alone. */
+  PASS_SHADE,
+
+  /** Write depth and which triangle is there, leaving shading to a separate resolve pass. */
+  PASS_VISIBILITY,
+} pass_t;
+
+/** Shade a run of pixels [x1, x2] on row y for one depth format. Unless test is set, the run is known to be inside the triangle. */
+FORCE_INLINE void triangle_span_scalar_format(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass, depth_format_t format) {
+  // The edge functions are integers, so they step across exactly
+  int64_t e0 = edge_at(s->edges[0], x1, y);
+  int64_t e1 = edge_at(s->edges[1], x1, y);
+  int64_t e2 = edge_at(s->edges[2], x1, y);
+
+  // Each plane, already evaluated along this row
+  // A pixel's value is then just row + dx * x, which is how the vector shaders work it out too, so they all agree to the bit
+  const float z_row = s->z.c + s->z.dy * (float) y;
+  const float tx_row = s->tx.c + s->tx.dy * (float) y;
+  const float ty_row = s->ty.c + s->ty.dy * (float) y;
+  const float nz_row = s->nz.c + s->nz.dy * (float) y;
+  const int mipmaps = options.mipmaps;
+
+  for (int x = x1; x <= x2; ++x) {
+    // If all edge functions are nonnegative, we are inside
+    // If this pixel is above the pixel already drawn here, then draw it
+    // The shading pass instead looks for the pixel that won, which wrote exactly this depth
+    float depth = z_row + s->z.dx * (float) x;
+    float depth_old = depth_read(o_depth, x, y, format);
+    int visible = pass == PASS_SHADE ? depth_quantize(depth, format) == depth_old && depth_owner(o_depth, x, y) == (uint32_t) s->triangle : depth > depth_old;
+
+    // Compute lighting intensity with a forward lamp
+    // With the lamp straight down the Z-axis, that is just the normal's Z
+    float lighting = nz_row + s->nz.dx * (float) x;
+
+    // If the triangle is forward-facing
+    if ((!test || (e0 | e1 | e2) >= 0) && visible && lighting > 0) {
+      if (pass != PASS_DEPTH) {
+        // Look up the texture color
+        vec2_t texcoord = {
+          .x = tx_row + s->tx.dx * (float) x,
+          .y = ty_row + s->ty.dx * (float) x,
+        };
+        color_t color;
+        if (mipmaps) {
+          color = texture_sample(texture, texcoord.x, texcoord.y, s->lod);
+        } else {
+          // Only texels inside the texture have an index in every layout, so keep to its edges
+          const image_t* level = &texture->level[0];
+          int tx = min(max((int) (texcoord.x * (float) level->width), 0), level->width - 1);
+          int ty = min(max((int) (texcoord.y * (float) level->height), 0), level->height - 1);
+          color = image_texel(level, tx, ty);
+        }
+
+        // Light the fragment
+        color.r *= lighting;
+        color.g *= lighting;
+        color.b *= lighting;
+
+        // Write image data out
+        image_pixel_swizzled(o_color, x, y) = color;
+      }
+      if (pass != PASS_SHADE) {
+        depth_write(o_depth, x, y, depth_quantize(depth, format), format);
+      }
+      if (pass == PASS_DEPTH) {
+        depth_owner(o_depth, x, y) = (uint32_t) s->triangle;
+      }
+    }
+
+    // Step the edges one pixel to the right
+    e0 += s->edges[0].dx;
+    e1 += s->edges[1].dx;
+    e2 += s->edges[2].dx;
+  }
+}
+
+/** Shade a run of pixels [x1, x2] on row y. Unless test is set, the run is known to be inside the triangle. */
+static void triangle_span_scalar(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass) {
+  switch (o_depth->format) {
+    case DEPTH_D16:
+      triangle_span_scalar_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D16);
+      break;
+    case DEPTH_D24:
+      triangle_span_scalar_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D24);
+      break;
+    case DEPTH_D32F:
+      triangle_span_scalar_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D32F);
+      break;
+  }
+}
+
+#ifdef HAVE_SSE2
+/** Evaluate an edge function at four pixels from (x, y) using SSE2, as two vectors of two, and how far to step them. */
+inline static void edge_lanes_sse2(const edge_t* edge, int x, int y, __m128i lanes[2], __m128i* step) {
+  int64_t e = edge_at(*edge, x, y);
+  lanes[0] = _mm_set_epi64x(e + edge->dx, e);
+  lanes[1] = _mm_add_epi64(lanes[0], _mm_set1_epi64x(2 * edge->dx));
+  *step = _mm_set1_epi64x(4 * edge->dx);
+}
+
+/**
+ * Test four pixels against the edges using SSE2, then step the edges on past them.
+ *
+ * Each edge function takes two vectors of two 64-bit lanes, pixels 0-1 and
+ * 2-3. Returns a mask of the pixels inside all three edges.
+ */
+inline static __m128 edges_inside_sse2(__m128i edges[3][2], const __m128i steps[3]) {
+  // A pixel is inside when the OR of its edge functions has a clear sign bit
+  __m128i low = _mm_or_si128(_mm_or_si128(edges[0][0], edges[1][0]), edges[2][0]);
+  __m128i high = _mm_or_si128(_mm_or_si128(edges[0][1], edges[1][1]), edges[2][1]);
+
+  // Spelled out rather than looped, which keeps them in registers
+  edges[0][0] = _mm_add_epi64(edges[0][0], steps[0]);
+  edges[0][1] = _mm_add_epi64(edges[0][1], steps[0]);
+  edges[1][0] = _mm_add_epi64(edges[1][0], steps[1]);
+  edges[1][1] = _mm_add_epi64(edges[1][1], steps[1]);
+  edges[2][0] = _mm_add_epi64(edges[2][0], steps[2]);
+  edges[2][1] = _mm_add_epi64(edges[2][1], steps[2]);
+
+  // The sign bits are in the upper halves of the 64-bit lanes, so pack those into one vector
+  __m128i upper = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1)));
+  return _mm_castsi128_ps(_mm_cmpgt_epi32(upper, _mm_set1_epi32(-1)));
+}
+
+/** Load four depth values as floats using SSE2. */
+FORCE_INLINE __m128 depth_load_sse2(const void* at, depth_format_t format) {
+  switch (format) {
+    case DEPTH_D16:
+      return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*) at), _mm_setzero_si128()));
+    case DEPTH_D24:
+      return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) at));
+    case DEPTH_D32F:
+      break;
+  }
+  return _mm_loadu_ps((const float*) at);
+}
+
+/** Round four interpolated depths to what the format can store using SSE2. Works like depth_quantize(). */
+FORCE_INLINE __m128 depth_quantize_sse2(__m128 depth, depth_format_t format) {
+  if (format == DEPTH_D32F) {
+    return depth;
+  }
+  __m128 clamped = _mm_min_ps(_mm_max_ps(depth, _mm_setzero_ps()), _mm_set1_ps(depth_max(format)));
+  return _mm_cvtepi32_ps(_mm_cvttps_epi32(clamped));
+}
+
+/** Store four quantized depth values using SSE2. */
+FORCE_INLINE void depth_store_sse2(void* at, __m128 depth, depth_format_t format) {
+  __m128i value = _mm_cvttps_epi32(depth);
+  switch (format) {
+    case DEPTH_D16:
+      // SSE2 cannot pack to unsigned 16 bits, but the values fit already, so just gather the low halves
+      value = _mm_shufflelo_epi16(value, _MM_SHUFFLE(3, 3, 2, 0));
+      value = _mm_shufflehi_epi16(value, _MM_SHUFFLE(3, 3, 2, 0));
+      _mm_storel_epi64((__m128i*) at, _mm_shuffle_epi32(value, _MM_SHUFFLE(3, 3, 2, 0)));
+      return;
+    case DEPTH_D24:
+      _mm_storeu_si128((__m128i*) at, value);
+      return;
+    case DEPTH_D32F:
+      break;
+  }
+  _mm_storeu_ps((float*) at, depth);
+}
+
+/** Shade a run of pixels four at a time using SSE2 for one depth format. Works like triangle_span_scalar_format(). */
+FORCE_INLINE void triangle_span_sse2_format(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass, depth_format_t format) {
+  const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+  const __m128i lane_index = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128i channel = _mm_set1_epi32(0xff);
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+
+  // Vectors start on multiples of four, so each one lies within a row of a swizzled tile and is contiguous in memory
+  // The first and last can hang over the ends of the run
+  int x_start = x1 & ~3;
+
+  // The edge functions at the first four pixels, stepped exactly four pixels at a time from there
+  // They are only read when testing, but zero them anyway so the compiler can see they are set
+  __m128i edges[3][2] = {{{0}}};
+  __m128i edge_steps[3] = {{0}};
+  if (test) {
+    edge_lanes_sse2(&s->edges[0], x_start, y, edges[0], &edge_steps[0]);
+    edge_lanes_sse2(&s->edges[1], x_start, y, edges[1], &edge_steps[1]);
+    edge_lanes_sse2(&s->edges[2], x_start, y, edges[2], &edge_steps[2]);
+  }
+
+  // Each plane, already evaluated along this row
+  // A lane's value is then just row + dx * x
+  const __m128 z_row = _mm_set1_ps(s->z.c + s->z.dy * (float) y), z_dx = _mm_set1_ps(s->z.dx);
+  const __m128 tx_row = _mm_set1_ps(s->tx.c + s->tx.dy * (float) y), tx_dx = _mm_set1_ps(s->tx.dx);
+  const __m128 ty_row = _mm_set1_ps(s->ty.c + s->ty.dy * (float) y), ty_dx = _mm_set1_ps(s->ty.dx);
+  const __m128 nz_row = _mm_set1_ps(s->nz.c + s->nz.dy * (float) y), nz_dx = _mm_set1_ps(s->nz.dx);
+  const int mipmaps = options.mipmaps;
+
+  for (int x = x_start; x <= x2; x += 4) {
+    __m128 fx = _mm_add_ps(_mm_set1_ps((float) x), lanes);
+
+    // Lanes outside the run are masked off
+    // Their pixels still sit in this tile, which nobody else is drawing, so writing them back unchanged is safe
+    __m128i span = _mm_and_si128(_mm_cmpgt_epi32(lane_index, _mm_set1_epi32(x1 - x - 1)), _mm_cmpgt_epi32(_mm_set1_epi32(x2 - x + 1), lane_index));
+    __m128 mask = _mm_castsi128_ps(span);
+
+    // Coverage mask
+    if (test) {
+      mask = _mm_and_ps(mask, edges_inside_sse2(edges, edge_steps));
+    }
+
+    // Depth test mask
+    void* depth_out = depth_address(o_depth, x, y, format);
+    __m128 depth_old = depth_load_sse2(depth_out, format);
+    __m128 depth = _mm_add_ps(z_row, _mm_mul_ps(z_dx, fx));
+    __m128i* owner_out = pass != PASS_DEPTH && pass != PASS_SHADE ? NULL : (__m128i*) &depth_owner(o_depth, x, y);
+    if (pass == PASS_SHADE) {
+      mask = _mm_and_ps(mask, _mm_cmpeq_ps(depth_quantize_sse2(depth, format), depth_old));
+      mask = _mm_and_ps(mask, _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128(owner_out), _mm_set1_epi32(s->triangle))));
+    } else {
+      mask = _mm_and_ps(mask, _mm_cmpgt_ps(depth, depth_old));
+    }
+
+    // Forward-facing mask
+    // With the lamp straight down the Z-axis, the lighting intensity is just the normal's Z
+    __m128 lighting = _mm_add_ps(nz_row, _mm_mul_ps(nz_dx, fx));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(lighting, zero));
+
+    int bits = _mm_movemask_ps(mask);
+    if (!bits) {
+      continue;
+    }
+    __m128i keep = _mm_castps_si128(mask);
+
+    // The depth pass is done once it knows where depth goes
+    if (pass == PASS_DEPTH) {
+      depth_store_sse2(depth_out, _mm_or_ps(_mm_and_ps(mask, depth_quantize_sse2(depth, format)), _mm_andnot_ps(mask, depth_old)), format);
+      _mm_storeu_si128(owner_out, _mm_or_si128(_mm_and_si128(keep, _mm_set1_epi32(s->triangle)), _mm_andnot_si128(keep, _mm_loadu_si128(owner_out))));
+      continue;
+    }
+
+    // Look up the texture colors
+    // SSE2 has no gather, so fetch lane by lane
+    __m128 texcoord_x = _mm_add_ps(tx_row, _mm_mul_ps(tx_dx, fx));
+    __m128 texcoord_y = _mm_add_ps(ty_row, _mm_mul_ps(ty_dx, fx));
+    int32_t texels[4];
+    if (mipmaps) {
+      float u[4];
+      float v[4];
+      _mm_storeu_ps(u, texcoord_x);
+      _mm_storeu_ps(v, texcoord_y);
+      for (int i = 0; i < 4; ++i) {
+        texels[i] = bits & (1 << i) ? texture_sample(texture, u[i], v[i], s->lod).value : 0;
+      }
+    } else {
+      const image_t* level = &texture->level[0];
+      int32_t tx[4];
+      int32_t ty[4];
+      _mm_storeu_si128((__m128i*) tx, _mm_cvttps_epi32(_mm_mul_ps(texcoord_x, _mm_set1_ps((float) level->width))));
+      _mm_storeu_si128((__m128i*) ty, _mm_cvttps_epi32(_mm_mul_ps(texcoord_y, _mm_set1_ps((float) level->height))));
+      for (int i = 0; i < 4; ++i) {
+        texels[i] = bits & (1 << i) ? image_texel(level, min(max(tx[i], 0), level->width - 1), min(max(ty[i], 0), level->height - 1)).value : 0;
+      }
+    }
+    __m128i texel = _mm_loadu_si128((const __m128i*) texels);
+
+    // Light the fragments channel by channel
+    __m128i r = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(texel, channel)), lighting));
+    __m128i g = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 8), channel)), lighting));
+    __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texel, 16), channel)), lighting));
+    __m128i color = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_and_si128(texel, alpha)));
+
+    // Write image data out where all the masks passed
+    __m128i* color_out = (__m128i*) &image_pixel_swizzled(o_color, x, y);
+    _mm_storeu_si128(color_out, _mm_or_si128(_mm_and_si128(keep, color), _mm_andnot_si128(keep, _mm_loadu_si128(color_out))));
+    if (pass == PASS_FORWARD) {
+      depth_store_sse2(depth_out, _mm_or_ps(_mm_and_ps(mask, depth_quantize_sse2(depth, format)), _mm_andnot_ps(mask, depth_old)), format);
+    }
+  }
+}
+
+/** Shade a run of pixels four at a time using SSE2. Works like triangle_span_scalar(). */
+static void triangle_span_sse2(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass) {
+  switch (o_depth->format) {
+    case DEPTH_D16:
+      triangle_span_sse2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D16);
+      break;
+    case DEPTH_D24:
+      triangle_span_sse2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D24);
+      break;
+    case DEPTH_D32F:
+      triangle_span_sse2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D32F);
+      break;
+  }
+}
+#endif
+
+#ifdef HAVE_AVX2
+/** Evaluate an edge function at eight pixels from (x, y) using AVX2. Works like edge_lanes_sse2(). */
+__attribute__((target("avx2")))
+inline static void edge_lanes_avx2(const edge_t* edge, int x, int y, __m256i lanes[2], __m256i* step) {
+  // Building the lanes one by one would cost more than a short span does, so pick multiples of dx with masks
+  __m256i e = _mm256_set1_epi64x(edge_at(*edge, x, y));
+  __m256i dx = _mm256_set1_epi64x(edge->dx);
+  __m256i dx2 = _mm256_add_epi64(dx, dx);
+  __m256i dx4 = _mm256_add_epi64(dx2, dx2);
+  __m256i odd = _mm256_and_si256(_mm256_setr_epi64x(0, -1, 0, -1), dx);
+  __m256i upper = _mm256_and_si256(_mm256_setr_epi64x(0, 0, -1, -1), dx2);
+  lanes[0] = _mm256_add_epi64(e, _mm256_add_epi64(odd, upper));
+  lanes[1] = _mm256_add_epi64(lanes[0], dx4);
+  *step = _mm256_add_epi64(dx4, dx4);
+}
+
+/** Test eight pixels against the edges using AVX2, then step the edges on past them. Works like edges_inside_sse2(). */
+__attribute__((target("avx2")))
+inline static __m256 edges_inside_avx2(__m256i edges[3][2], const __m256i steps[3]) {
+  __m256i low = _mm256_or_si256(_mm256_or_si256(edges[0][0], edges[1][0]), edges[2][0]);
+  __m256i high = _mm256_or_si256(_mm256_or_si256(edges[0][1], edges[1][1]), edges[2][1]);
+
+  // Spelled out rather than looped, which keeps them in registers
+  edges[0][0] = _mm256_add_epi64(edges[0][0], steps[0]);
+  edges[0][1] = _mm256_add_epi64(edges[0][1], steps[0]);
+  edges[1][0] = _mm256_add_epi64(edges[1][0], steps[1]);
+  edges[1][1] = _mm256_add_epi64(edges[1][1], steps[1]);
+  edges[2][0] = _mm256_add_epi64(edges[2][0], steps[2]);
+  edges[2][1] = _mm256_add_epi64(edges[2][1], steps[2]);
+
+  // Shuffling works within 128-bit halves, which leaves the upper halves in the order 0 1 4 5 2 3 6 7
+  __m256 upper = _mm256_shuffle_ps(_mm256_castsi256_ps(low), _mm256_castsi256_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+  __m256i ordered = _mm256_permute4x64_epi64(_mm256_castps_si256(upper), _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm256_castsi256_ps(_mm256_cmpgt_epi32(ordered, _mm256_set1_epi32(-1)));
+}
+
+/** Load eight depth values as floats using AVX2. */
+__attribute__((target("avx2")))
+FORCE_INLINE __m256 depth_load_avx2(const void* at, depth_format_t format) {
+  switch (format) {
+    case DEPTH_D16:
+      return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) at)));
+    case DEPTH_D24:
+      return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) at));
+    case DEPTH_D32F:
+      break;
+  }
+  return _mm256_loadu_ps((const float*) at);
+}
+
+/** Round eight interpolated depths to what the format can store using AVX2. Works like depth_quantize(). */
+__attribute__((target("avx2")))
+FORCE_INLINE __m256 depth_quantize_avx2(__m256 depth, depth_format_t format) {
+  if (format == DEPTH_D32F) {
+    return depth;
+  }
+  __m256 clamped = _mm256_min_ps(_mm256_max_ps(depth, _mm256_setzero_ps()), _mm256_set1_ps(depth_max(format)));
+  return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(clamped));
+}
+
+/** Store quantized depth values using AVX2 in the lanes set in keep, leaving the rest as they were in old. */
+__attribute__((target("avx2")))
+FORCE_INLINE void depth_store_avx2(void* at, __m256 depth, __m256 old, __m256i keep, depth_format_t format) {
+  switch (format) {
+    case DEPTH_D16: {
+      // There is no masked store for 16 bits, so blend and write all eight
+      __m256i value = _mm256_cvttps_epi32(_mm256_blendv_ps(old, depth, _mm256_castsi256_ps(keep)));
+      _mm_storeu_si128((__m128i*) at, _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1)));
+      return;
+    }
+    case DEPTH_D24:
+      _mm256_maskstore_epi32((int*) at, keep, _mm256_cvttps_epi32(depth));
+      return;
+    case DEPTH_D32F:
+      break;
+  }
+  _mm256_maskstore_ps((float*) at, keep, depth);
+}
+
+/** Add eight texels into the channel sums using AVX2, scaled by their weights. */
+__attribute__((target("avx2")))
+FORCE_INLINE void texel_accumulate_avx2(__m256i texel, __m256 weight, __m256 sum[3]) {
+  const __m256i channel = _mm256_set1_epi32(0xff);
+  sum[0] = _mm256_add_ps(sum[0], _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, channel)), weight));
+  sum[1] = _mm256_add_ps(sum[1], _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), channel)), weight));
+  sum[2] = _mm256_add_ps(sum[2], _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), channel)), weight));
+}
+
+/** Spread the low 16 bits of eight values out to their even bits using AVX2. Works like morton_spread(). */
+__attribute__((target("avx2")))
+FORCE_INLINE __m256i morton_spread_avx2(__m256i value) {
+  value = _mm256_and_si256(value, _mm256_set1_epi32(0x0000ffff));
+  value = _mm256_and_si256(_mm256_or_si256(value, _mm256_slli_epi32(value, 8)), _mm256_set1_epi32(0x00ff00ff));
+  value = _mm256_and_si256(_mm256_or_si256(value, _mm256_slli_epi32(value, 4)), _mm256_set1_epi32(0x0f0f0f0f));
+  value = _mm256_and_si256(_mm256_or_si256(value, _mm256_slli_epi32(value, 2)), _mm256_set1_epi32(0x33333333));
+  value = _mm256_and_si256(_mm256_or_si256(value, _mm256_slli_epi32(value, 1)), _mm256_set1_epi32(0x55555555));
+  return value;
+}
+
+/** Get where eight texels are stored in a texture using AVX2, for a gather. Works like image_index(). */
+__attribute__((target("avx2")))
+FORCE_INLINE __m256i image_index_avx2(const image_t* image, __m256i x, __m256i y) {
+  int bits;
+  int blocks;
+  switch (image->layout) {
+    case IMAGE_LINEAR:
+      return _mm256_add_epi32(x, _mm256_mullo_epi32(y, _mm256_set1_epi32(image->width)));
+    case IMAGE_SWIZZLED:
+      bits = SWIZZLE_BITS;
+      blocks = (int) swizzle_tiles(image->width);
+      break;
+    case IMAGE_BLOCKED:
+      bits = TEXTURE_BLOCK_BITS;
+      blocks = (int) texture_blocks(image->width);
+      break;
+    case IMAGE_MORTON:
+    default:
+      return _mm256_or_si256(morton_spread_avx2(x), _mm256_slli_epi32(morton_spread_avx2(y), 1));
+  }
+
+  // Swizzled tiles and blocks are both square runs of pixels in rows of them
+  __m128i shift = _mm_cvtsi32_si128(bits);
+  __m256i low = _mm256_set1_epi32((1 << bits) - 1);
+  __m256i block = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(y, shift), _mm256_set1_epi32(blocks)), _mm256_srl_epi32(x, shift));
+  __m256i within = _mm256_or_si256(_mm256_sll_epi32(_mm256_and_si256(y, low), shift), _mm256_and_si256(x, low));
+  return _mm256_or_si256(_mm256_sll_epi32(block, _mm_cvtsi32_si128(2 * bits)), within);
+}
+
+/** Add bilinear samples of a mip level at eight points into the channel sums using AVX2. Only lanes set in keep are fetched. Works like texture_bilinear(). */
+__attribute__((target("avx2")))
+FORCE_INLINE void texture_bilinear_avx2(const image_t* level, __m256 u, __m256 v, __m256 weight, __m256i keep, __m256 sum[3]) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i x_last = _mm256_set1_epi32(level->width - 1);
+  const __m256i y_last = _mm256_set1_epi32(level->height - 1);
+
+  __m256 x = _mm256_sub_ps(_mm256_mul_ps(u, _mm256_set1_ps((float) level->width)), half);
+  __m256 y = _mm256_sub_ps(_mm256_mul_ps(v, _mm256_set1_ps((float) level->height)), half);
+  __m256 x_floor = _mm256_floor_ps(x);
+  __m256 y_floor = _mm256_floor_ps(y);
+  __m256 fx = _mm256_sub_ps(x, x_floor);
+  __m256 fy = _mm256_sub_ps(y, y_floor);
+  __m256i x0 = _mm256_cvttps_epi32(x_floor);
+  __m256i y0 = _mm256_cvttps_epi32(y_floor);
+  __m256i x1 = _mm256_min_epi32(_mm256_max_epi32(x0, zero), x_last);
+  __m256i x2 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(x0, _mm256_set1_epi32(1)), zero), x_last);
+  __m256i y1 = _mm256_min_epi32(_mm256_max_epi32(y0, zero), y_last);
+  __m256i y2 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y0, _mm256_set1_epi32(1)), zero), y_last);
+
+  // Same order of operations as the scalar version, so both give the same colors
+  const int* pixels = (const int*) level->pixels;
+  __m256 gx = _mm256_sub_ps(one, fx);
+  __m256 gy = _mm256_sub_ps(one, fy);
+  texel_accumulate_avx2(_mm256_mask_i32gather_epi32(zero, pixels, image_index_avx2(level, x1, y1), keep, 4), _mm256_mul_ps(_mm256_mul_ps(gx, gy), weight), sum);
+  texel_accumulate_avx2(_mm256_mask_i32gather_epi32(zero, pixels, image_index_avx2(level, x2, y1), keep, 4), _mm256_mul_ps(_mm256_mul_ps(fx, gy), weight), sum);
+  texel_accumulate_avx2(_mm256_mask_i32gather_epi32(zero, pixels, image_index_avx2(level, x1, y2), keep, 4), _mm256_mul_ps(_mm256_mul_ps(gx, fy), weight), sum);
+  texel_accumulate_avx2(_mm256_mask_i32gather_epi32(zero, pixels, image_index_avx2(level, x2, y2), keep, 4), _mm256_mul_ps(_mm256_mul_ps(fx, fy), weight), sum);
+}
+
+/** Sample a texture at eight points with trilinear filtering using AVX2. Works like texture_sample(), and returns packed colors. */
+__attribute__((target("avx2")))
+FORCE_INLINE __m256i texture_sample_avx2(const texture_t* texture, __m256 u, __m256 v, float lod, __m256i keep) {
+  // The level is the same across a triangle, so it is picked once for all eight
+  int level = (int) lod;
+  float blend = lod - (float) level;
+
+  __m256 sum[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+  texture_bilinear_avx2(&texture->level[level], u, v, _mm256_set1_ps(1.0f - blend), keep, sum);
+  if (blend > 0) {
+    texture_bilinear_avx2(&texture->level[level + 1], u, v, _mm256_set1_ps(blend), keep, sum);
+  }
+
+  const __m256 half = _mm256_set1_ps(0.5f);
+  __m256i r = _mm256_cvttps_epi32(_mm256_add_ps(sum[0], half));
+  __m256i g = _mm256_cvttps_epi32(_mm256_add_ps(sum[1], half));
+  __m256i b = _mm256_cvttps_epi32(_mm256_add_ps(sum[2], half));
+  return _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_set1_epi32((int) 0xff000000)));
+}
+
+/** Shade a run of pixels eight at a time using AVX2 for one depth format. Works like triangle_span_scalar_format(). */
+__attribute__((target("avx2")))
+FORCE_INLINE void triangle_span_avx2_format(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass, depth_format_t format) {
+  const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256i channel = _mm256_set1_epi32(0xff);
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  const __m256 texture_width = _mm256_set1_ps((float) texture->level[0].width);
+  const __m256 texture_height = _mm256_set1_ps((float) texture->level[0].height);
+  const int mipmaps = options.mipmaps;
+
+  // Vectors start on multiples of eight, so each one is exactly a row of a swizzled tile
+  // The first and last can hang over the ends of the run
+  int x_start = x1 & ~(SWIZZLE_SIZE - 1);
+
+  // The edge functions at the first eight pixels, stepped exactly eight pixels at a time from there
+  // They are only read when testing, but zero them anyway so the compiler can see they are set
+  __m256i edges[3][2] = {{{0}}};
+  __m256i edge_steps[3] = {{0}};
+  if (test) {
+    edge_lanes_avx2(&s->edges[0], x_start, y, edges[0], &edge_steps[0]);
+    edge_lanes_avx2(&s->edges[1], x_start, y, edges[1], &edge_steps[1]);
+    edge_lanes_avx2(&s->edges[2], x_start, y, edges[2], &edge_steps[2]);
+  }
+
+  // Each plane, already evaluated along this row
+  // A lane's value is then just row + dx * x
+  const __m256 z_row = _mm256_set1_ps(s->z.c + s->z.dy * (float) y), z_dx = _mm256_set1_ps(s->z.dx);
+  const __m256 tx_row = _mm256_set1_ps(s->tx.c + s->tx.dy * (float) y), tx_dx = _mm256_set1_ps(s->tx.dx);
+  const __m256 ty_row = _mm256_set1_ps(s->ty.c + s->ty.dy * (float) y), ty_dx = _mm256_set1_ps(s->ty.dx);
+  const __m256 nz_row = _mm256_set1_ps(s->nz.c + s->nz.dy * (float) y), nz_dx = _mm256_set1_ps(s->nz.dx);
+
+  for (int x = x_start; x <= x2; x += 8) {
+    __m256 fx = _mm256_add_ps(_mm256_set1_ps((float) x), lanes);
+
+    // Lanes outside the run are masked off
+    // Their pixels still sit in this tile, which nobody else is drawing, so writing them back unchanged is safe
+    __m256i span = _mm256_and_si256(_mm256_cmpgt_epi32(lane_index, _mm256_set1_epi32(x1 - x - 1)), _mm256_cmpgt_epi32(_mm256_set1_epi32(x2 - x + 1), lane_index));
+    __m256 mask = _mm256_castsi256_ps(span);
+
+    // Coverage mask
+    if (test) {
+      mask = _mm256_and_ps(mask, edges_inside_avx2(edges, edge_steps));
+    }
+
+    // Depth test mask
+    void* depth_out = depth_address(o_depth, x, y, format);
+    __m256 depth_old = depth_load_avx2(depth_out, format);
+    __m256 depth = _mm256_add_ps(z_row, _mm256_mul_ps(z_dx, fx));
+    int* owner_out = pass != PASS_DEPTH && pass != PASS_SHADE ? NULL : (int*) &depth_owner(o_depth, x, y);
+    if (pass == PASS_SHADE) {
+      mask = _mm256_and_ps(mask, _mm256_cmp_ps(depth_quantize_avx2(depth, format), depth_old, _CMP_EQ_OQ));
+      mask = _mm256_and_ps(mask, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) owner_out), _mm256_set1_epi32(s->triangle))));
+    } else {
+      mask = _mm256_and_ps(mask, _mm256_cmp_ps(depth, depth_old, _CMP_GT_OQ));
+    }
+
+    // Forward-facing mask
+    // With the lamp straight down the Z-axis, the lighting intensity is just the normal's Z
+    __m256 lighting = _mm256_add_ps(nz_row, _mm256_mul_ps(nz_dx, fx));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(lighting, zero, _CMP_GT_OQ));
+
+    if (_mm256_testz_ps(mask, mask)) {
+      continue;
+    }
+    __m256i keep = _mm256_castps_si256(mask);
+
+    // The depth pass is done once it knows where depth goes
+    if (pass == PASS_DEPTH) {
+      depth_store_avx2(depth_out, depth_quantize_avx2(depth, format), depth_old, keep, format);
+      _mm256_maskstore_epi32(owner_out, keep, _mm256_set1_epi32(s->triangle));
+      continue;
+    }
+
+    // Gather the texture colors
+    __m256 texcoord_x = _mm256_add_ps(tx_row, _mm256_mul_ps(tx_dx, fx));
+    __m256 texcoord_y = _mm256_add_ps(ty_row, _mm256_mul_ps(ty_dx, fx));
+    __m256i texel;
+    if (mipmaps) {
+      texel = texture_sample_avx2(texture, texcoord_x, texcoord_y, s->lod, keep);
+    } else {
+      const image_t* level = &texture->level[0];
+      __m256i tx = _mm256_cvttps_epi32(_mm256_mul_ps(texcoord_x, texture_width));
+      __m256i ty = _mm256_cvttps_epi32(_mm256_mul_ps(texcoord_y, texture_height));
+      tx = _mm256_min_epi32(_mm256_max_epi32(tx, _mm256_setzero_si256()), _mm256_set1_epi32(level->width - 1));
+      ty = _mm256_min_epi32(_mm256_max_epi32(ty, _mm256_setzero_si256()), _mm256_set1_epi32(level->height - 1));
+      texel = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*) level->pixels, image_index_avx2(level, tx, ty), keep, 4);
+    }
+
+    // Light the fragments channel by channel
+    __m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texel, channel)), lighting));
+    __m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), channel)), lighting));
+    __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), channel)), lighting));
+    __m256i color = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_and_si256(texel, alpha)));
+
+    // Write image data out where all the masks passed
+    _mm256_maskstore_epi32(&image_pixel_swizzled(o_color, x, y).value, keep, color);
+    if (pass == PASS_FORWARD) {
+      depth_store_avx2(depth_out, depth_quantize_avx2(depth, format), depth_old, keep, format);
+    }
+  }
+}
+
+/** Shade a run of pixels eight at a time using AVX2. Works like triangle_span_scalar(). */
+__attribute__((target("avx2")))
+static void triangle_span_avx2(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass) {
+  switch (o_depth->format) {
+    case DEPTH_D16:
+      triangle_span_avx2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D16);
+      break;
+    case DEPTH_D24:
+      triangle_span_avx2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D24);
+      break;
+    case DEPTH_D32F:
+      triangle_span_avx2_format(o_color, o_depth, s, texture, x1, x2, y, test, pass, DEPTH_D32F);
+      break;
+  }
+}
+#endif
+
+/** What the visibility buffer holds for a pixel: the triangle drawn there, and where on it. */
+typedef struct {
+  // Index of the triangle in the geometry, or VISIBILITY_NONE if nothing was drawn
+  uint32_t triangle;
+
+  // Barycentric coordinates of the pixel center, less u = 1 - v - w
+  float v;
+  float w;
+} visibility_t;
+
+/** Marks a pixel with no triangle drawn on it. */
+#define VISIBILITY_NONE UINT32_MAX
+
+/** A buffer of one visibility record per pixel. */
+typedef struct {
+  int width;
+  int height;
+  visibility_t* samples;
+} visibility_buffer_t;
+
+/** Access a record in a visibility buffer. Like the other render targets, it is stored in swizzled tiles. */
+#define visibility_sample(buffer, x, y) \
+  ((buffer)->samples[swizzle_index((x), (y), (buffer)->width)])
+
+/** Record the visible parts of a run of pixels in the visibility buffer for one depth format. Works like triangle_span_scalar_format(), but without shading. */
+FORCE_INLINE void visibility_span_format(visibility_buffer_t* o_visibility, depth_buffer_t* o_depth, const setup_t* s, int x1, int x2, int y, int test, depth_format_t format) {
+  int64_t e0 = edge_at(s->edges[0], x1, y);
+  int64_t e1 = edge_at(s->edges[1], x1, y);
+  int64_t e2 = edge_at(s->edges[2], x1, y);
+  const float v_row = s->bary[1].c + s->bary[1].dy * (float) y;
+  const float w_row = s->bary[2].c + s->bary[2].dy * (float) y;
+  const float z_row = s->z.c + s->z.dy * (float) y;
+  const float nz_row = s->nz.c + s->nz.dy * (float) y;
+
+  for (int x = x1; x <= x2; ++x) {
+    float depth = z_row + s->z.dx * (float) x;
+    float lighting = nz_row + s->nz.dx * (float) x;
+
+    // Same tests as when shading, with the lamp straight down the Z-axis
+    if ((!test || (e0 | e1 | e2) >= 0) && depth > depth_read(o_depth, x, y, format) && lighting > 0) {
+      depth_write(o_depth, x, y, depth_quantize(depth, format), format);
+      visibility_sample(o_visibility, x, y) = (visibility_t) {
+        .triangle = (uint32_t) s->triangle,
+        .v = v_row + s->bary[1].dx * (float) x,
+        .w = w_row + s->bary[2].dx * (float) x,
+      };
+    }
+
+    e0 += s->edges[0].dx;
+    e1 += s->edges[1].dx;
+    e2 += s->edges[2].dx;
+  }
+}
+
+/** Record the visible parts of a run of pixels in the visibility buffer. */
+static void visibility_span(visibility_buffer_t* o_visibility, depth_buffer_t* o_depth, const setup_t* s, int x1, int x2, int y, int test) {
+  switch (o_depth->format) {
+    case DEPTH_D16:
+      visibility_span_format(o_visibility, o_depth, s, x1, x2, y, test, DEPTH_D16);
+      break;
+    case DEPTH_D24:
+      visibility_span_format(o_visibility, o_depth, s, x1, x2, y, test, DEPTH_D24);
+      break;
+    case DEPTH_D32F:
+      visibility_span_format(o_visibility, o_depth, s, x1, x2, y, test, DEPTH_D32F);
+      break;
+  }
+}
+
+/** The span shader in use. This is picked at startup from the options and what the processor supports. */
+static void (*triangle_span)(image_t* o_color, depth_buffer_t* o_depth, const setup_t* s, const texture_t* texture, int x1, int x2, int y, int test, pass_t pass) = triangle_span_scalar;
+
+/** Fill a triangle by walking its whole bounding box. The visibility buffer is only needed for its pass. */
+static void triangle(image_t* o_color, depth_buffer_t* o_depth, visibility_buffer_t* o_visibility, const setup_t* s, const texture_t* texture, pass_t pass) {
+  targets_materialize(o_color, o_depth, s->x1, s->y1, s->x2, s->y2);
+  for (int y = s->y1; y <= s->y2; ++y) {
+    if (pass == PASS_VISIBILITY) {
+      visibility_span(o_visibility, o_depth, s, s->x1, s->x2, y, 1);
+    } else {
+      triangle_span(o_color, o_depth, s, texture, s->x1, s->x2, y, 1, pass);
+    }
+  }
+}
+
+/** Edge length of a square screen tile. Triangles are binned per tile. */
+#define TILE_SIZE 64
+
+/** Edge length of a square block within a tile. Blocks are accepted or rejected as a whole, and are the swizzled tiles of the render targets. */
+#define BLOCK_SIZE SWIZZLE_SIZE
+
+/** How much of a rectangle a triangle covers. */
+typedef enum {
+  COVERAGE_NONE,
+  COVERAGE_PARTIAL,
+  COVERAGE_FULL,
+} coverage_t;
+
+/** Classify the pixels in [x1, x2] x [y1, y2] against a triangle's edges. */
+static coverage_t triangle_coverage(const setup_t* s, int x1, int y1, int x2, int y2) {
+  // The edge functions are linear, so their extremes over the rectangle are at its corners
+  coverage_t coverage = COVERAGE_FULL;
+  for (int i = 0; i < 3; ++i) {
+    int inside = (edge_at(s->edges[i], x1, y1) >= 0)
+        + (edge_at(s->edges[i], x2, y1) >= 0)
+        + (edge_at(s->edges[i], x1, y2) >= 0)
+        + (edge_at(s->edges[i], x2, y2) >= 0);
+
+    // All corners are outside one edge, so the whole rectangle is too
+    if (inside == 0) {
+      return COVERAGE_NONE;
+    }
+
+    // This edge cuts through the rectangle
+    if (inside < 4) {
+      coverage = COVERAGE_PARTIAL;
+    }
+  }
+  return coverage;
+}
+
+/** The triangles overlapping one screen tile, in submission order. */
+typedef struct {
+  int size;
+  int capacity;
+  int* triangles;
+} bin_t;
+
+/**
+ * A hierarchical depth buffer for the tiled rasterizer.
+ *
+ * Every block remembers the farthest depth stored anywhere in it, and every
+ * tile the farthest depth of its blocks. A triangle no nearer than that
+ * cannot pass the depth test anywhere in the block or tile, so it can be
+ * skipped there without looking at a single pixel. Nearer depths only ever
+ * replace farther ones, so a stale bound is still a safe one.
+ */
+typedef struct {
+  int blocks_x;
+  float* blocks;
+
+  int tiles_x;
+  float* tiles;
+} hiz_t;
+
+/** Find the farthest depth stored in a block for one depth format. */
+FORCE_INLINE float hiz_block_scan_format(const depth_buffer_t* o_depth, int block_x, int block_y, depth_format_t format) {
+  int x2 = min(block_x + BLOCK_SIZE, o_depth->width);
+  int y2 = min(block_y + BLOCK_SIZE, o_depth->height);
+  float farthest = INFINITY;
+  for (int y = block_y; y < y2; ++y) {
+    for (int x = block_x; x < x2; ++x) {
+      farthest = min(farthest, depth_read(o_depth, x, y, format));
+    }
+  }
+  return farthest;
+}
+
+/** Find the farthest depth stored in a block. */
+static float hiz_block_scan(const depth_buffer_t* o_depth, int block_x, int block_y) {
+  // A block still waiting to be cleared is all far, and need not be looked at
+  if (depth_pending(o_depth, block_x, block_y)) {
+    return 0.0f;
+  }
+
+  switch (o_depth->format) {
+    case DEPTH_D16:
+      return hiz_block_scan_format(o_depth, block_x, block_y, DEPTH_D16);
+    case DEPTH_D24:
+      return hiz_block_scan_format(o_depth, block_x, block_y, DEPTH_D24);
+    case DEPTH_D32F:
+      break;
+  }
+  return hiz_block_scan_format(o_depth, block_x, block_y, DEPTH_D32F);
+}
+
+/** Start off the bounds of a tile and its blocks from what is in the depth buffer. */
+static void hiz_tile_init(hiz_t* hiz, const depth_buffer_t* o_depth, int tile_x, int tile_y) {
+  float farthest = INFINITY;
+  for (int block_y = tile_y; block_y < min(tile_y + TILE_SIZE, o_depth->height); block_y += BLOCK_SIZE) {
+    for (int block_x = tile_x; block_x < min(tile_x + TILE_SIZE, o_depth->width); block_x += BLOCK_SIZE) {
+      float* block = &hiz->blocks[block_x / BLOCK_SIZE + block_y / BLOCK_SIZE * hiz->blocks_x];
+      *block = hiz_block_scan(o_depth, block_x, block_y);
+      farthest = min(farthest, *block);
+    }
+  }
+  hiz->tiles[tile_x / TILE_SIZE + tile_y / TILE_SIZE * hiz->tiles_x] = farthest;
+}
+
+/** Recompute the bound of a tile from its blocks. */
+static void hiz_tile_update(hiz_t* hiz, const depth_buffer_t* o_depth, int tile_x, int tile_y) {
+  float* tile = &hiz->tiles[tile_x / TILE_SIZE + tile_y / TILE_SIZE * hiz->tiles_x];
+
+  // Bounds only ever get nearer, so as soon as a block still matches the old bound, it stands
+  float farthest = INFINITY;
+  for (int block_y = tile_y; block_y < min(tile_y + TILE_SIZE, o_depth->height); block_y += BLOCK_SIZE) {
+    for (int block_x = tile_x; block_x < min(tile_x + TILE_SIZE, o_depth->width); block_x += BLOCK_SIZE) {
+      float block = hiz->blocks[block_x / BLOCK_SIZE + block_y / BLOCK_SIZE * hiz->blocks_x];
+      if (block == *tile) {
+        return;
+      }
+      farthest = min(farthest, block);
+    }
+  }
+  *tile = farthest;
+}
+
+/** Check whether a triangle is hidden behind a depth bound in the given pass. */
+static int hiz_hidden(float z_max, float farthest, pass_t pass) {
+  // The shading pass looks for depths equal to the stored ones, so a triangle reaching exactly the bound is not hidden
+  return pass == PASS_SHADE ? z_max < farthest : z_max <= farthest;
+}
+
+/** Counts of work skipped by the tiled rasterizer. */
+typedef struct {
+  long tiles_occluded;
+  long blocks_occluded;
+  long blocks_outside;
+} raster_stats_t;
+
+/** Fill the part of a triangle that falls in one tile, a block at a time. The hierarchical depth buffer is optional, and the visibility buffer is only needed for its pass. */
+static void triangle_tile(image_t* o_color, depth_buffer_t* o_depth, visibility_buffer_t* o_visibility, hiz_t* hiz, const setup_t* s, const texture_t* texture, int tile_x, int tile_y, pass_t pass, raster_stats_t* stats) {
+  // Give up on the whole tile if everything in it is already nearer
+  float* tile_farthest = hiz ? &hiz->tiles[tile_x / TILE_SIZE + tile_y / TILE_SIZE * hiz->tiles_x] : NULL;
+  if (hiz && hiz_hidden(s->z_max, *tile_farthest, pass)) {
+    stats->tiles_occluded++;
+    return;
+  }
+
+  // The part of the tile that the triangle's bounding box overlaps
+  int x1 = max(s->x1, tile_x);
+  int y1 = max(s->y1, tile_y);
+  int x2 = min(min(s->x2, tile_x + TILE_SIZE - 1), o_color->width - 1);
+  int y2 = min(min(s->y2, tile_y + TILE_SIZE - 1), o_color->height - 1);
+
+  // Visit the blocks in that part of the tile
+  // Blocks are aligned to the tile, which is aligned to the screen
+  int stale = 0;
+  for (int block_y = y1 - (y1 - tile_y) % BLOCK_SIZE; block_y <= y2; block_y += BLOCK_SIZE) {
+    for (int block_x = x1 - (x1 - tile_x) % BLOCK_SIZE; block_x <= x2; block_x += BLOCK_SIZE) {
+      // Skip the block if everything in it is already nearer
+      float* block_farthest = hiz ? &hiz->blocks[block_x / BLOCK_SIZE + block_y / BLOCK_SIZE * hiz->blocks_x] : NULL;
+      if (hiz && hiz_hidden(s->z_max, *block_farthest, pass)) {
+        stats->blocks_occluded++;
+        continue;
+      }
+
+      int bx1 = max(x1, block_x);
+      int by1 = max(y1, block_y);
+      int bx2 = min(x2, block_x + BLOCK_SIZE - 1);
+      int by2 = min(y2, block_y + BLOCK_SIZE - 1);
+
+      // Skip blocks entirely outside, and drop the inside test for blocks entirely inside
+      coverage_t coverage = triangle_coverage(s, bx1, by1, bx2, by2);
+      if (coverage == COVERAGE_NONE) {
+        stats->blocks_outside++;
+        continue;
+      }
+      targets_materialize(o_color, o_depth, bx1, by1, bx2, by2);
+      for (int y = by1; y <= by2; ++y) {
+        if (pass == PASS_VISIBILITY) {
+          visibility_span(o_visibility, o_depth, s, bx1, bx2, y, coverage == COVERAGE_PARTIAL);
+        } else {
+          triangle_span(o_color, o_depth, s, texture, bx1, bx2, y, coverage == COVERAGE_PARTIAL, pass);
+        }
+      }
+
+      // Tighten the block's bound to what is there now, but only when the whole block was covered
+      // Partly covered blocks nearly always still have some far pixel left, so scanning them rarely pays off
+      // The tile's bound can only move if this block was what held it down
+      // The shading pass leaves depth alone, so there is nothing to tighten
+      if (hiz && coverage == COVERAGE_FULL && pass != PASS_SHADE) {
+        float farthest = *block_farthest;
+        *block_farthest = hiz_block_scan(o_depth, block_x, block_y);
+        stale |= farthest == *tile_farthest && *block_farthest != farthest;
+      }
+    }
+  }
+
+  // Then the tile's bound from its blocks
+  if (stale) {
+    hiz_tile_update(hiz, o_depth, tile_x, tile_y);
+  }
+}
+
+/** Everything the tile workers need to draw a frame. */
+typedef struct {
+  image_t* o_color;
+  depth_buffer_t* o_depth;
+  visibility_buffer_t* o_visibility;
+  const setup_t* setups;
+  const texture_t* texture;
+
+  // Where to send each row of tiles once all of them are drawn, if anywhere, and how many are left in each row
+  image_stream_t* o_stream;
+  pthread_mutex_t rows_lock;
+  int* rows_left;
+
+  // Tile grid and the triangles binned into each tile
+  int tiles_x;
+  int tiles_y;
+  bin_t* bins;
+
+  // Hierarchical depth buffer, if enabled
+  hiz_t* hiz;
+
+  // One work queue and set of statistics per worker
+  int workers;
+  deque_t* queues;
+  raster_stats_t* stats;
+} tiles_job_t;
+
+/** Draw tiles until there are none left anywhere. */
+static void tiles_worker(void* arg, int index) {
+  tiles_job_t* job = arg;
+
+  int tile;
+  while ((tile = deque_next(job->queues, job->workers, index)) >= 0) {
+    // Draw the triangles in this tile in the order they were submitted
+    // Nobody else touches this tile's pixels, so the result does not depend on who draws it
+    int tile_x = tile % job->tiles_x * TILE_SIZE;
+    int tile_y = tile / job->tiles_x * TILE_SIZE;
+    bin_t* bin = &job->bins[tile];
+
+    // Start the tile's depth bounds off from whatever is in the depth buffer
+    if (job->hiz && bin->size > 0) {
+      hiz_tile_init(job->hiz, job->o_depth, tile_x, tile_y);
+    }
+
+    if (options.shading == SHADING_DEFERRED) {
+      // Settle the tile's depth first, then shade what survived while the tile is still in cache
+      for (int i = 0; i < bin->size; ++i) {
+        triangle_tile(job->o_color, job->o_depth, job->o_visibility, job->hiz, &job->setups[bin->triangles[i]], job->texture, tile_x, tile_y, PASS_DEPTH, &job->stats[index]);
+      }
+
+      // The bounds are exact again after a fresh scan, which rejects more in the shading pass
+      if (job->hiz && bin->size > 0) {
+        hiz_tile_init(job->hiz, job->o_depth, tile_x, tile_y);
+      }
+
+      for (int i = 0; i < bin->size; ++i) {
+        triangle_tile(job->o_color, job->o_depth, job->o_visibility, job->hiz, &job->setups[bin->triangles[i]], job->texture, tile_x, tile_y, PASS_SHADE, &job->stats[index]);
+      }
+    } else {
+      pass_t pass = options.shading == SHADING_VISIBILITY ? PASS_VISIBILITY : PASS_FORWARD;
+      for (int i = 0; i < bin->size; ++i) {
+        triangle_tile(job->o_color, job->o_depth, job->o_visibility, job->hiz, &job->setups[bin->triangles[i]], job->texture, tile_x, tile_y, pass, &job->stats[index]);
+      }
+    }
+
+    // The last tile done in a row sends the row off to be written, while the others keep drawing
+    if (job->o_stream) {
+      pthread_mutex_lock(&job->rows_lock);
+      int finished = --job->rows_left[tile / job->tiles_x] == 0;
+      pthread_mutex_unlock(&job->rows_lock);
+      if (finished) {
+        image_stream_band(job->o_stream, tile / job->tiles_x);
+      }
+    }
+  }
+}
+
+/** Fill a list of triangles in order by binning them into screen tiles. */
+static void triangles_tiled(image_t* o_color, depth_buffer_t* o_depth, visibility_buffer_t* o_visibility, image_stream_t* o_stream, const setup_t* setups, int count, const texture_t* texture) {
+  tiles_job_t job = {
+    .o_color = o_color,
+    .o_depth = o_depth,
+    .o_visibility = o_visibility,
+    .o_stream = o_stream,
+    .setups = setups,
+    .texture = texture,
+    .tiles_x = (o_color->width + TILE_SIZE - 1) / TILE_SIZE,
+    .tiles_y = (o_color->height + TILE_SIZE - 1) / TILE_SIZE,
+  };
+  int tiles = job.tiles_x * job.tiles_y;
+  job.bins = calloc(tiles, sizeof(bin_t));
+
+  // Drop each triangle into the bins of the tiles it touches
+  for (int i = 0; i < count; ++i) {
+    const setup_t* s = &setups[i];
+    for (int tile_y = s->y1 / TILE_SIZE; tile_y <= min(s->y2 / TILE_SIZE, job.tiles_y - 1); ++tile_y) {
+      for (int tile_x = s->x1 / TILE_SIZE; tile_x <= min(s->x2 / TILE_SIZE, job.tiles_x - 1); ++tile_x) {
+        // Reject the tile outright if the triangle misses it
+        if (triangle_coverage(s, tile_x * TILE_SIZE, tile_y * TILE_SIZE, tile_x * TILE_SIZE + TILE_SIZE - 1, tile_y * TILE_SIZE + TILE_SIZE - 1) == COVERAGE_NONE) {
+          continue;
+        }
+
+        bin_t* bin = &job.bins[tile_x + tile_y * job.tiles_x];
+        if (bin->size == bin->capacity) {
+          bin->capacity = bin->capacity ? bin->capacity * 2 : 16;
+          bin->triangles = realloc(bin->triangles, bin->capacity * sizeof(int));
+        }
+        bin->triangles[bin->size] = i;
+        bin->size++;
+      }
+    }
+  }
+
+  // The hierarchical depth buffer is filled in tile by tile as the workers get to them
+  hiz_t hiz = {
+    .blocks_x = (o_depth->width + BLOCK_SIZE - 1) / BLOCK_SIZE,
+    .tiles_x = job.tiles_x,
+  };
+  if (options.hiz) {
+    hiz.blocks = malloc(hiz.blocks_x * ((o_depth->height + BLOCK_SIZE - 1) / BLOCK_SIZE) * sizeof(float));
+    hiz.tiles = malloc(tiles * sizeof(float));
+    job.hiz = &hiz;
+  }
+
+  // Deal out contiguous runs of tiles to the workers to start with
+  job.workers = min(thread_count(), tiles);
+  job.queues = malloc(job.workers * sizeof(deque_t));
+  job.stats = calloc(job.workers, sizeof(raster_stats_t));
+  for (int i = 0; i < job.workers; ++i) {
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+    job.queues[i].head = tiles * i / job.workers;
+    job.queues[i].tail = tiles * (i + 1) / job.workers;
+  }
+
+  // Count down the tiles in each row, which go out in bands of the same height
+  if (o_stream) {
+    pthread_mutex_init(&job.rows_lock, NULL);
+    job.rows_left = malloc(job.tiles_y * sizeof(int));
+    for (int i = 0; i < job.tiles_y; ++i) {
+      job.rows_left[i] = job.tiles_x;
+    }
+  }
+
+  // Then let them loose
+  parallel_run(job.workers, tiles_worker, &job);
+
+  if (options.stats) {
+    raster_stats_t total = {0};
+    for (int i = 0; i < job.workers; ++i) {
+      total.tiles_occluded += job.stats[i].tiles_occluded;
+      total.blocks_occluded += job.stats[i].blocks_occluded;
+      total.blocks_outside += job.stats[i].blocks_outside;
+    }
+    fprintf(stderr, "raster: %ld tiles occluded, %ld blocks occluded, %ld blocks outside\n", total.tiles_occluded, total.blocks_occluded, total.blocks_outside);
+  }
+
+  // Clean up
+  if (o_stream) {
+    pthread_mutex_destroy(&job.rows_lock);
+    free(job.rows_left);
+  }
+  for (int i = 0; i < job.workers; ++i) {
+    pthread_mutex_destroy(&job.queues[i].lock);
+  }
+  free(job.stats);
+  free(job.queues);
+  free(hiz.tiles);
+  free(hiz.blocks);
+  for (int i = 0; i < tiles; ++i) {
+    free(job.bins[i].triangles);
+  }
+  free(job.bins);
+}
+
+/** A read-only view of a whole file in memory. */
+typedef struct {
+  const char* data;
+  size_t size;
+} file_map_t;
+
+/** Map a file into memory. */
+static int file_map(file_map_t* map, const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info)) {
+    close(fd);
+    return -1;
+  }
+
+  // Mapping nothing is an error, but an empty file is not
+  map->size = (size_t) info.st_size;
+  map->data = NULL;
+  if (map->size > 0) {
+    void* data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+
+    // We read front to back, so let the kernel read ahead aggressively
+    madvise(data, map->size, MADV_SEQUENTIAL);
+    map->data = data;
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+  return 0;
+}
+
+/** Unmap a file. */
+static void file_unmap(file_map_t* map) {
+  if (map->data) {
+    munmap((void*) map->data, map->size);
+  }
+}
+
+/** One corner of a face, as indices into the vertex data. */
+typedef struct {
+  int position;
+  int texcoord;
+  int normal;
+} corner_t;
+
+/** A triangular face. */
+typedef struct {
+  corner_t a;
+  corner_t b;
+  corner_t c;
+} face_t;
+
+/** A triangle mesh. */
+typedef struct {
+  // Vertex position data
+  int positions_size;
+  vec3_t* positions;
+
+  // Vertex texture coordinate data
+  int texcoords_size;
+  vec2_t* texcoords;
+
+  // Vertex normal coordinate data
+  int normals_size;
+  vec3_t* normals;
+
+  // Face data
+  int faces_size;
+  face_t* faces;
+
+  // When loaded from a cache, the data above points into this mapping
+  file_map_t cache;
+} mesh_t;
+
+/** Clean up a mesh. */
+static void mesh_free(mesh_t* mesh) {
+  if (mesh->cache.data) {
+    file_unmap(&mesh->cache);
+    return;
+  }
+
+  free(mesh->faces);
+  free(mesh->normals);
+  free(mesh->texcoords);
+  free(mesh->positions);
+}
+
+/** Grow a dynamic array so it has room for one more element. */
+#define array_reserve(array, size, capacity) \
+    do { \
+      if ((size) == (capacity)) { \
+        (capacity) = (capacity) ? (capacity) * 2 : 16; \
+        (array) = realloc((array), (capacity) * sizeof(*(array))); \
+      } \
+    } while (0)
+
+/** Skip spaces and tabs, but not line ends. */
+inline static const char* obj_skip_space(const char* at, const char* end) {
+  while (at < end && (*at == ' ' || *at == '\t' || *at == '\r')) {
+    at++;
+  }
+  return at;
+}
+
+/** Skip to the start of the next line. */
+inline static const char* obj_skip_line(const char* at, const char* end) {
+  const char* newline = memchr(at, '\n', end - at);
+  return newline ? newline + 1 : end;
+}
+
+/** Parse an integer. Returns NULL if there is none, or if it does not fit in an int. */
+inline static const char* obj_parse_int(const char* at, const char* end, int* value) {
+  int negative = at < end && *at == '-';
+  if (at < end && (*at == '-' || *at == '+')) {
+    at++;
+  }
+
+  const char* digits = at;
+  int result = 0;
+  while (at < end && *at >= '0' && *at <= '9') {
+    // Wrapping around could turn a huge index into one that passes the range checks
+    int digit = *at - '0';
+    if (result > (INT_MAX - digit) / 10) {
+      return NULL;
+    }
+    result = result * 10 + digit;
+    at++;
+  }
+  if (at == digits) {
+    return NULL;
+  }
+
+  *value = negative ? -result : result;
+  return at;
+}
+
+/** Parse a decimal floating point number. Returns NULL if there is none. */
+static const char* obj_parse_float(const char* at, const char* end, float* value) {
+  // Exact powers of ten that a double can hold
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  int negative = at < end && *at == '-';
+  if (at < end && (*at == '-' || *at == '+')) {
+    at++;
+  }
+
+  // Gather up to 18 significant digits and remember where the decimal point goes
+  // This is a lot more digits than a float can hold, so the rest only shift the exponent
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int exponent = 0;
+  int digits = 0;
+  for (; at < end && *at >= '0' && *at <= '9'; ++at, ++digits) {
+    if (significant < 18) {
+      mantissa = mantissa * 10 + (uint64_t) (*at - '0');
+      significant += mantissa != 0;
+    } else {
+      exponent++;
+    }
+  }
+  if (at < end && *at == '.') {
+    for (at++; at < end && *at >= '0' && *at <= '9'; ++at, ++digits) {
+      if (significant < 18) {
+        mantissa = mantissa * 10 + (uint64_t) (*at - '0');
+        significant += mantissa != 0;
+        exponent--;
+      }
+    }
+  }
+  if (digits == 0) {
+    return NULL;
+  }
+
+  // Scientific notation
+  if (at < end && (*at == 'e' || *at == 'E')) {
+    int scientific;
+    const char* after = obj_parse_int(at + 1, end, &scientific);
+    if (!after) {
+      return NULL;
+    }
+    // Anything past this is zero or infinite as a float anyway, and clamping keeps the sum from overflowing
+    exponent += min(max(scientific, -1000), 1000);
+    at = after;
+  }
+
+  // Scale by the power of ten
+  double result = (double) mantissa;
+  if (exponent < 0) {
+    result = -exponent <= 22 ? result / powers[-exponent] : result * pow(10.0, exponent);
+  } else if (exponent > 0) {
+    result = exponent <= 22 ? result * powers[exponent] : result * pow(10.0, exponent);
+  }
+
+  *value = (float) (negative ? -result : result);
+  return at;
+}
+
+/** Parse some floats separated by whitespace. Returns NULL if there are not enough. */
+inline static const char* obj_parse_floats(const char* at, const char* end, float* values, int count) {
+  for (int i = 0; i < count && at; ++i) {
+    at = obj_parse_float(obj_skip_space(at, end), end, &values[i]);
+  }
+  return at;
+}
+
+/** Parse a face corner like 1/2/3. Returns NULL if it is not one. */
+inline static const char* obj_parse_corner(const char* at, const char* end, corner_t* corner) {
+  at = obj_parse_int(at, end, &corner->position);
+  if (!at || at == end || *at++ != '/') {
+    return NULL;
+  }
+  at = obj_parse_int(at, end, &corner->texcoord);
+  if (!at || at == end || *at++ != '/') {
+    return NULL;
+  }
+  return obj_parse_int(at, end, &corner->normal);
+}
+
+/**
+ * A byte range of an OBJ file, parsed on its own.
+ *
+ * A chunk does not know how many vertices come before it. One-based indices
+ * in its faces are simply made zero-based, but negative (relative) ones can
+ * only be resolved against the chunk's own vertices. Those are remembered so
+ * they can be shifted into place once every chunk has been counted.
+ */
+typedef struct {
+  const char* begin;
+  const char* end;
+
+  // Data parsed from this chunk alone
+  mesh_t mesh;
+  int positions_capacity;
+  int texcoords_capacity;
+  int normals_capacity;
+  int faces_capacity;
+
+  // Index fields that are relative to the start of this chunk
+  // Each is encoded as (face * 3 + corner) * 3 + field
+  int relatives_size;
+  int relatives_capacity;
+  int* relatives;
+
+  // Where parsing failed, if it did
+  const char* error;
+
+  // Where this chunk's data lands in the whole mesh
+  int positions_offset;
+  int texcoords_offset;
+  int normals_offset;
+  int faces_offset;
+} obj_chunk_t;
+
+/** Get one index field of a face. Corners and fields are numbered in the order they are written. */
+inline static int* face_index(face_t* face, int corner, int field) {
+  corner_t* c = corner == 0 ? &face->a : corner == 1 ? &face->b : &face->c;
+  return field == 0 ? &c->position : field == 1 ? &c->texcoord : &c->normal;
+}
+
+/** Make the indices of a face corner zero-based and note which are relative. Returns nonzero if one is zero. */
+inline static int obj_chunk_localize(const obj_chunk_t* chunk, corner_t* corner, int* relative) {
+  int sizes[3] = {chunk->mesh.positions_size, chunk->mesh.texcoords_size, chunk->mesh.normals_size};
+  int* fields[3] = {&corner->position, &corner->texcoord, &corner->normal};
+  *relative = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (*fields[i] > 0) {
+      *fields[i] -= 1;
+    } else if (*fields[i] < 0) {
+      *fields[i] += sizes[i];
+      *relative |= 1 << i;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Store a face parsed from a chunk, along with which of its index fields are relative. */
+static void obj_chunk_add_face(obj_chunk_t* chunk, const face_t* face, const int relative[3]) {
+  int index = chunk->mesh.faces_size;
+  array_reserve(chunk->mesh.faces, chunk->mesh.faces_size, chunk->faces_capacity);
+  chunk->mesh.faces[chunk->mesh.faces_size++] = *face;
+
+  for (int corner = 0; corner < 3; ++corner) {
+    for (int field = 0; field < 3; ++field) {
+      if (relative[corner] & (1 << field)) {
+        array_reserve(chunk->relatives, chunk->relatives_size, chunk->relatives_capacity);
+        chunk->relatives[chunk->relatives_size++] = (index * 3 + corner) * 3 + field;
+      }
+    }
+  }
+}
+
+/**
+ * Parse a chunk of Wavefront OBJ text.
+ *
+ * Only what we need is understood: positions, texture coordinates, normals,
+ * and faces whose corners have all three. Faces with more than three corners
+ * are split into a fan of triangles. Everything else is skipped.
+ */
+static void obj_parse_chunk(obj_chunk_t* chunk) {
+  const char* end = chunk->end;
+  for (const char* at = chunk->begin; at < end; at = obj_skip_line(at, end)) {
+    const char* line = at;
+    at = obj_skip_space(at, end);
+    if (at + 1 >= end) {
+      continue;
+    }
+
+    if (at[0] == 'v' && (at[1] == ' ' || at[1] == '\t')) {
+      // This line encodes a position vector
+      vec3_t position;
+      at = obj_parse_floats(at + 2, end, &position.x, 3);
+      if (!at) {
+        chunk->error = line;
+        return;
+      }
+
+      array_reserve(chunk->mesh.positions, chunk->mesh.positions_size, chunk->positions_capacity);
+      chunk->mesh.positions[chunk->mesh.positions_size++] = position;
+    } else if (at[0] == 'v' && at[1] == 't' && at + 2 < end && (at[2] == ' ' || at[2] == '\t')) {
+      // This line encodes a texture coordinate vector (any third component is ignored)
+      vec2_t texcoord;
+      at = obj_parse_floats(at + 2, end, &texcoord.x, 2);
+      if (!at) {
+        chunk->error = line;
+        return;
+      }
+
+      array_reserve(chunk->mesh.texcoords, chunk->mesh.texcoords_size, chunk->texcoords_capacity);
+      chunk->mesh.texcoords[chunk->mesh.texcoords_size++] = texcoord;
+    } else if (at[0] == 'v' && at[1] == 'n' && at + 2 < end && (at[2] == ' ' || at[2] == '\t')) {
+      // This line encodes a normal vector
+      vec3_t normal;
+      at = obj_parse_floats(at + 2, end, &normal.x, 3);
+      if (!at) {
+        chunk->error = line;
+        return;
+      }
+
+      array_reserve(chunk->mesh.normals, chunk->mesh.normals_size, chunk->normals_capacity);
+      chunk->mesh.normals[chunk->mesh.normals_size++] = normal;
+    } else if (at[0] == 'f' && (at[1] == ' ' || at[1] == '\t')) {
+      // This line encodes a face
+      // Corners after the third each add a triangle fanning out from the first
+      face_t face;
+      int relative[3] = {0};
+      int corners = 0;
+      at = obj_skip_space(at + 2, end);
+      while (at < end && *at != '\n' && *at != '#') {
+        corner_t corner;
+        int corner_relative;
+        at = obj_parse_corner(at, end, &corner);
+        if (!at || obj_chunk_localize(chunk, &corner, &corner_relative)) {
+          chunk->error = line;
+          return;
+        }
+        at = obj_skip_space(at, end);
+
+        if (corners == 0) {
+          face.a = corner;
+          relative[0] = corner_relative;
+        } else if (corners == 1) {
+          face.b = corner;
+          relative[1] = corner_relative;
+        } else {
+          face.c = corner;
+          relative[2] = corner_relative;
+          obj_chunk_add_face(chunk, &face, relative);
+          face.b = corner;
+          relative[1] = corner_relative;
+        }
+        corners++;
+      }
+      if (corners < 3) {
+        chunk->error = line;
+        return;
+      }
+    }
+  }
+}
+
+/** Parse a chunk on a worker thread. */
+static void obj_parse_worker(void* arg, int index) {
+  obj_parse_chunk(&((obj_chunk_t*) arg)[index]);
+}
+
+/** Check that an index is inside an array. */
+#define index_valid(index, size) ((index) >= 0 && (index) < (size))
+
+/** Check that every corner of a face refers to vertex data the mesh has. */
+static int face_valid(const face_t* face, const mesh_t* mesh) {
+  return index_valid(face->a.position, mesh->positions_size) && index_valid(face->b.position, mesh->positions_size) && index_valid(face->c.position, mesh->positions_size)
+      && index_valid(face->a.texcoord, mesh->texcoords_size) && index_valid(face->b.texcoord, mesh->texcoords_size) && index_valid(face->c.texcoord, mesh->texcoords_size)
+      && index_valid(face->a.normal, mesh->normals_size) && index_valid(face->b.normal, mesh->normals_size) && index_valid(face->c.normal, mesh->normals_size);
+}
+
+/** Everything the workers need to splice chunks into a whole mesh. */
+typedef struct {
+  obj_chunk_t* chunks;
+  mesh_t* mesh;
+  int invalid;
+} obj_splice_job_t;
+
+/** Move a chunk's data to its place in the whole mesh, shifting its relative indices to match. */
+static void obj_splice_worker(void* arg, int index) {
+  obj_splice_job_t* job = arg;
+  obj_chunk_t* chunk = &job->chunks[index];
+  mesh_t* mesh = job->mesh;
+
+  // Shift relative indices by the vertices in the chunks before this one
+  int offsets[3] = {chunk->positions_offset, chunk->texcoords_offset, chunk->normals_offset};
+  for (int i = 0; i < chunk->relatives_size; ++i) {
+    int relative = chunk->relatives[i];
+    *face_index(&chunk->mesh.faces[relative / 9], relative / 3 % 3, relative % 3) += offsets[relative % 3];
+  }
+
+  // Only now can indices be checked against the whole mesh
+  for (int i = 0; i < chunk->mesh.faces_size; ++i) {
+    if (!face_valid(&chunk->mesh.faces[i], mesh)) {
+      job->invalid = 1;
+      break;
+    }
+  }
+
+  // Copy everything into place
+  memcpy(mesh->positions + chunk->positions_offset, chunk->mesh.positions, chunk->mesh.positions_size * sizeof(vec3_t));
+  memcpy(mesh->texcoords + chunk->texcoords_offset, chunk->mesh.texcoords, chunk->mesh.texcoords_size * sizeof(vec2_t));
+  memcpy(mesh->normals + chunk->normals_offset, chunk->mesh.normals, chunk->mesh.normals_size * sizeof(vec3_t));
+  memcpy(mesh->faces + chunk->faces_offset, chunk->mesh.faces, chunk->mesh.faces_size * sizeof(face_t));
+}
+
+/** The least amount of text worth handing to a thread of its own. */
+#define OBJ_CHUNK_SIZE (1 << 20)
+
+/**
+ * Parse Wavefront OBJ text into a mesh.
+ *
+ * The text is cut into chunks at line breaks, and the chunks are parsed on
+ * separate threads. A prefix sum over the chunk sizes then says where each
+ * chunk's data goes, and the chunks are spliced together in parallel.
+ */
+static int obj_parse(mesh_t* mesh, const char* begin, const char* end) {
+  int count = (int) min((size_t) thread_count(), (size_t) (end - begin) / OBJ_CHUNK_SIZE + 1);
+  obj_chunk_t* chunks = calloc(count, sizeof(obj_chunk_t));
+
+  // Cut at the first line break after each evenly spaced point
+  const char* at = begin;
+  for (int i = 0; i < count; ++i) {
+    chunks[i].begin = at;
+    if (i + 1 < count) {
+      at = max(at, begin + (end - begin) * (i + 1) / count);
+      at = at < end ? obj_skip_line(at, end) : end;
+    } else {
+      at = end;
+    }
+    chunks[i].end = at;
+  }
 
-    // Look up vertex normal vectors
-    vec3_t n1 = normals[face.a.normal];
-    vec3_t n2 = normals[face.b.normal];
-    vec3_t n3 = normals[face.c.normal];
+  parallel_run(count, obj_parse_worker, chunks);
 
-    // The vector from P1 to P2
-    vec3_t p1p2 = {
-      .x = p2.x - p1.x,
-      .y = p2.y - p1.y,
-      .z = p2.z - p1.z,
-    };
+  // Add up where each chunk's data goes
+  *mesh = (mesh_t) {0};
+  int result = 0;
+  for (int i = 0; i < count; ++i) {
+    obj_chunk_t* chunk = &chunks[i];
 
-    // The vector from P1 to P3
-    vec3_t p1p3 = {
-      .x = p3.x - p1.x,
-      .y = p3.y - p1.y,
-      .z = p3.z - p1.z,
-    };
+    // Report the first error in the file
+    if (chunk->error && !result) {
+      int line = 1;
+      for (const char* c = begin; c < chunk->error; ++c) {
+        line += *c == '\n';
+      }
+      fprintf(stderr, "error: bad model data on line %d\n", line);
+      result = -1;
+    }
+
+    chunk->positions_offset = mesh->positions_size;
+    chunk->texcoords_offset = mesh->texcoords_size;
+    chunk->normals_offset = mesh->normals_size;
+    chunk->faces_offset = mesh->faces_size;
+    mesh->positions_size += chunk->mesh.positions_size;
+    mesh->texcoords_size += chunk->mesh.texcoords_size;
+    mesh->normals_size += chunk->mesh.normals_size;
+    mesh->faces_size += chunk->mesh.faces_size;
+  }
 
-    // The normalized normal vector to the face
-    vec3_t normal = norm3(cross3(p1p2, p1p3));
+  // Splice the chunks together
+  if (!result) {
+    mesh->positions = malloc(mesh->positions_size * sizeof(vec3_t));
+    mesh->texcoords = malloc(mesh->texcoords_size * sizeof(vec2_t));
+    mesh->normals = malloc(mesh->normals_size * sizeof(vec3_t));
+    mesh->faces = malloc(mesh->faces_size * sizeof(face_t));
 
-    // Project these vertices into our screen space
-    // This is naive just like in lesson 1 (we just drop the Z-axis altogether!)
-    vec3_t p1_screen = {
-      .x = (1.0f + p1.x) * (float) o_color->width * 0.5f,
-      .y = (1.0f - p1.y) * (float) o_color->height * 0.5f,
-      .z = (1.0f + p1.z) * (float) INT32_MAX * 0.5f,
-    };
-    vec3_t p2_screen = {
-      .x = (1.0f + p2.x) * (float) o_color->width * 0.5f,
-      .y = (1.0f - p2.y) * (float) o_color->height * 0.5f,
-      .z = (1.0f + p2.z) * (float) INT32_MAX * 0.5f,
+    obj_splice_job_t job = {
+      .chunks = chunks,
+      .mesh = mesh,
     };
-    vec3_t p3_screen = {
-      .x = (1.0f + p3.x) * (float) o_color->width * 0.5f,
-      .y = (1.0f - p3.y) * (float) o_color->height * 0.5f,
-      .z = (1.0f + p3.z) * (float) INT32_MAX * 0.5f,
+    parallel_run(count, obj_splice_worker, &job);
+    if (job.invalid) {
+      fprintf(stderr, "error: face refers to missing model data\n");
+      result = -1;
+    }
+  }
+
+  // Clean up chunks
+  for (int i = 0; i < count; ++i) {
+    mesh_free(&chunks[i].mesh);
+    free(chunks[i].relatives);
+  }
+  free(chunks);
+
+  return result;
+}
+
+/** Hash some bytes with 64-bit FNV-1a. */
+static uint64_t hash_bytes(const char* data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/** Identifies a mesh cache file. This changes whenever the layout does. */
+#define MESH_CACHE_MAGIC "MESH0002"
+
+/** Alignment of each array in a mesh cache file. */
+#define MESH_CACHE_ALIGN 64
+
+/**
+ * The header of a mesh cache file.
+ *
+ * The mesh arrays follow in the order positions, texture coordinates,
+ * normals, faces, each starting on a multiple of MESH_CACHE_ALIGN bytes.
+ * They are stored exactly as they sit in memory, so a cache is only good
+ * on the kind of machine that wrote it.
+ */
+typedef struct {
+  char magic[8];
+
+  // The model file the cache was built from
+  // Both of its times are kept to the nanosecond, as an edit can land within the second or have its modification time set back, but not its change time
+  uint64_t source_size;
+  int64_t source_mtime;
+  int64_t source_mtime_nsec;
+  int64_t source_ctime;
+  int64_t source_ctime_nsec;
+  uint64_t source_hash;
+
+  // Number of elements in each array
+  int32_t positions_size;
+  int32_t texcoords_size;
+  int32_t normals_size;
+  int32_t faces_size;
+} mesh_cache_header_t;
+
+/** Find where each array lives in a mesh cache file. Returns the size of the whole file. */
+static size_t mesh_cache_layout(const mesh_cache_header_t* header, size_t offsets[4]) {
+  size_t sizes[4] = {
+    (size_t) header->positions_size * sizeof(vec3_t),
+    (size_t) header->texcoords_size * sizeof(vec2_t),
+    (size_t) header->normals_size * sizeof(vec3_t),
+    (size_t) header->faces_size * sizeof(face_t),
+  };
+
+  size_t at = sizeof(mesh_cache_header_t);
+  for (int i = 0; i < 4; ++i) {
+    at = (at + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+    offsets[i] = at;
+    at += sizes[i];
+  }
+  return at;
+}
+
+/** Get the name of the cache file for a model file. The caller frees it. */
+static char* mesh_cache_name(const char* filename) {
+  char* name = malloc(strlen(filename) + sizeof(".cache"));
+  strcpy(name, filename);
+  strcat(name, ".cache");
+  return name;
+}
+
+/** Record the size and times of a model file in a mesh cache header. */
+static void mesh_cache_stamp(mesh_cache_header_t* header, const struct stat* source) {
+  header->source_size = (uint64_t) source->st_size;
+  header->source_mtime = (int64_t) source->st_mtim.tv_sec;
+  header->source_mtime_nsec = (int64_t) source->st_mtim.tv_nsec;
+  header->source_ctime = (int64_t) source->st_ctim.tv_sec;
+  header->source_ctime_nsec = (int64_t) source->st_ctim.tv_nsec;
+}
+
+/**
+ * Load a mesh from its cache file without parsing anything.
+ *
+ * The cache is good if the model file has the size and times recorded in
+ * it. If only the times differ, the model file is hashed, and the cache is
+ * still good (and gets the new times) if the hash matches. Faces are checked
+ * against the vertex counts either way, so a damaged cache cannot index past
+ * its arrays.
+ */
+static int mesh_cache_load(mesh_t* mesh, const char* filename, const struct stat* source) {
+  char* name = mesh_cache_name(filename);
+  file_map_t map;
+  if (file_map(&map, name)) {
+    free(name);
+    return -1;
+  }
+
+  // Check the header is ours and agrees with the file size
+  mesh_cache_header_t header;
+  size_t offsets[4];
+  if (map.size < sizeof(header)) {
+    goto fail;
+  }
+  memcpy(&header, map.data, sizeof(header));
+  if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic))
+      || header.positions_size < 0 || header.texcoords_size < 0 || header.normals_size < 0 || header.faces_size < 0
+      || mesh_cache_layout(&header, offsets) != map.size) {
+    goto fail;
+  }
+
+  // Check the cache was built from what is in the model file now
+  if (header.source_size != (uint64_t) source->st_size) {
+    goto fail;
+  }
+  mesh_cache_header_t stamp = header;
+  mesh_cache_stamp(&stamp, source);
+  if (memcmp(&stamp, &header, sizeof(header))) {
+    file_map_t source_map;
+    if (file_map(&source_map, filename)) {
+      goto fail;
+    }
+    uint64_t hash = hash_bytes(source_map.data, source_map.size);
+    file_unmap(&source_map);
+    if (hash != header.source_hash) {
+      goto fail;
+    }
+  }
+
+  // Use the arrays right where they are, once they are known to hang together
+  mesh_t loaded = {
+    .positions_size = header.positions_size,
+    .positions = (vec3_t*) (map.data + offsets[0]),
+    .texcoords_size = header.texcoords_size,
+    .texcoords = (vec2_t*) (map.data + offsets[1]),
+    .normals_size = header.normals_size,
+    .normals = (vec3_t*) (map.data + offsets[2]),
+    .faces_size = header.faces_size,
+    .faces = (face_t*) (map.data + offsets[3]),
+    .cache = map,
+  };
+  for (int i = 0; i < loaded.faces_size; ++i) {
+    if (!face_valid(&loaded.faces[i], &loaded)) {
+      goto fail;
+    }
+  }
+
+  // If the model was only touched, remember the new times to skip hashing next time
+  if (memcmp(&stamp, &header, sizeof(header))) {
+    int fd = open(name, O_WRONLY);
+    if (fd >= 0) {
+      if (pwrite(fd, &stamp, sizeof(stamp), 0) != (ssize_t) sizeof(stamp)) {
+        fprintf(stderr, "warning: failed to update mesh cache\n");
+      }
+      close(fd);
+    }
+  }
+
+  *mesh = loaded;
+  free(name);
+  return 0;
+
+fail:
+  file_unmap(&map);
+  free(name);
+  return -1;
+}
+
+/** Write a mesh to the cache file for a model file. */
+static int mesh_cache_save(const mesh_t* mesh, const char* filename, const struct stat* source, uint64_t source_hash) {
+  mesh_cache_header_t header = {
+    .magic = MESH_CACHE_MAGIC,
+    .source_hash = source_hash,
+    .positions_size = mesh->positions_size,
+    .texcoords_size = mesh->texcoords_size,
+    .normals_size = mesh->normals_size,
+    .faces_size = mesh->faces_size,
+  };
+  mesh_cache_stamp(&header, source);
+  size_t offsets[4];
+  size_t total = mesh_cache_layout(&header, offsets);
+
+  // Write to the side and move it into place at the end, so nobody ever maps half a cache
+  char* name = mesh_cache_name(filename);
+  char* temporary = malloc(strlen(name) + 32);
+  sprintf(temporary, "%s.%ld", name, (long) getpid());
+  FILE* file = fopen(temporary, "wb");
+  if (!file) {
+    free(temporary);
+    free(name);
+    return -1;
+  }
+
+  const void* arrays[4] = {mesh->positions, mesh->texcoords, mesh->normals, mesh->faces};
+  size_t ends[4] = {
+    offsets[0] + (size_t) mesh->positions_size * sizeof(vec3_t),
+    offsets[1] + (size_t) mesh->texcoords_size * sizeof(vec2_t),
+    offsets[2] + (size_t) mesh->normals_size * sizeof(vec3_t),
+    total,
+  };
+  static const char padding[MESH_CACHE_ALIGN] = {0};
+  int result = fwrite(&header, sizeof(header), 1, file) != 1;
+  size_t at = sizeof(header);
+  for (int i = 0; i < 4 && !result; ++i) {
+    result |= fwrite(padding, 1, offsets[i] - at, file) != offsets[i] - at;
+    result |= fwrite(arrays[i], 1, ends[i] - offsets[i], file) != ends[i] - offsets[i];
+    at = ends[i];
+  }
+  result |= fclose(file) != 0;
+
+  if (result || rename(temporary, name)) {
+    remove(temporary);
+    result = -1;
+  }
+  free(temporary);
+  free(name);
+  return result;
+}
+
+/** Load a mesh from a Wavefront OBJ file, going through its cache file if allowed. */
+static int mesh_load(mesh_t* mesh, const char* filename) {
+  struct stat source;
+  if (stat(filename, &source)) {
+    return -1;
+  }
+
+  // Skip all the parsing if we have done it before
+  if (options.cache && !mesh_cache_load(mesh, filename, &source)) {
+    return 0;
+  }
+
+  // The file is parsed straight out of the page cache
+  file_map_t map;
+  if (file_map(&map, filename)) {
+    return -1;
+  }
+
+  int result = obj_parse(mesh, map.data, map.data + map.size);
+  if (result) {
+    mesh_free(mesh);
+  } else if (options.cache && mesh_cache_save(mesh, filename, &source, hash_bytes(map.data, map.size))) {
+    // Not being able to save the cache is no reason to stop
+    fprintf(stderr, "warning: failed to write mesh cache\n");
+  }
+
+  file_unmap(&map);
+  return result;
+}
+
+/** The attributes of a vertex that get interpolated across triangles, side by side. */
+typedef struct {
+  vec2_t texcoord;
+  vec3_t normal;
+} vertex_t;
+
+/** Vertex positions, stored as one array per component so they can be transformed in batches. */
+typedef struct {
+  float* x;
+  float* y;
+  float* z;
+} positions_t;
+
+/** Allocate position streams. */
+static positions_t positions_alloc(int size) {
+  return (positions_t) {
+    .x = malloc(size * sizeof(float)),
+    .y = malloc(size * sizeof(float)),
+    .z = malloc(size * sizeof(float)),
+  };
+}
+
+/** Clean up position streams. */
+static void positions_free(positions_t* positions) {
+  free(positions->z);
+  free(positions->y);
+  free(positions->x);
+}
+
+/**
+ * A mesh welded down to a single index stream.
+ *
+ * Every distinct combination of position, texture coordinate and normal
+ * becomes one vertex, and each triangle is three indices into those.
+ */
+typedef struct {
+  int vertices_size;
+  positions_t positions;
+  vertex_t* vertices;
+
+  // Three per triangle
+  int triangles_size;
+  uint32_t* indices;
+} geometry_t;
+
+/** Clean up welded geometry. */
+static void geometry_free(geometry_t* geometry) {
+  free(geometry->indices);
+  free(geometry->vertices);
+  positions_free(&geometry->positions);
+}
+
+/** Hash a face corner. */
+inline static uint32_t corner_hash(corner_t corner) {
+  uint64_t hash = (uint64_t) (uint32_t) corner.position * 0x9e3779b97f4a7c15;
+  hash = (hash ^ (uint32_t) corner.texcoord) * 0xff51afd7ed558ccd;
+  hash = (hash ^ (uint32_t) corner.normal) * 0xc4ceb9fe1a85ec53;
+  return (uint32_t) (hash >> 32);
+}
+
+/** Check if two face corners are the same. */
+inline static int corner_equal(corner_t a, corner_t b) {
+  return a.position == b.position && a.texcoord == b.texcoord && a.normal == b.normal;
+}
+
+/**
+ * A set of distinct face corners.
+ *
+ * This is an open-addressed hash table from corner to vertex index. The
+ * corners themselves are kept in order of first appearance, which is also
+ * the order of the vertices they become.
+ */
+typedef struct {
+  // Slots hold a vertex index plus one, or zero when empty
+  uint32_t capacity;
+  uint32_t* slots;
+
+  int corners_size;
+  corner_t* corners;
+} corner_set_t;
+
+/** Find the slot for a corner, which is either empty or already holds it. */
+inline static uint32_t corner_set_find(const corner_set_t* set, corner_t corner) {
+  uint32_t slot = corner_hash(corner) & (set->capacity - 1);
+  while (set->slots[slot] && !corner_equal(set->corners[set->slots[slot] - 1], corner)) {
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  return slot;
+}
+
+/** Get the vertex index for a corner, adding it if it is new. */
+static uint32_t corner_set_add(corner_set_t* set, corner_t corner) {
+  uint32_t slot = corner_set_find(set, corner);
+  if (set->slots[slot]) {
+    return set->slots[slot] - 1;
+  }
+
+  // New corners go at the end
+  uint32_t index = (uint32_t) set->corners_size++;
+  set->corners[index] = corner;
+  set->slots[slot] = index + 1;
+
+  // Keep the table at most half full
+  if ((uint32_t) set->corners_size * 2 > set->capacity) {
+    free(set->slots);
+    set->capacity *= 2;
+    set->slots = calloc(set->capacity, sizeof(uint32_t));
+    for (int i = 0; i < set->corners_size; ++i) {
+      set->slots[corner_set_find(set, set->corners[i])] = (uint32_t) i + 1;
+    }
+  }
+
+  return index;
+}
+
+/** Weld a mesh into an interleaved vertex array and an index buffer. */
+static void geometry_weld(geometry_t* geometry, const mesh_t* mesh) {
+  // Start with room for about as many distinct corners as there are of the most common attribute
+  corner_set_t set = {
+    .capacity = 16,
+    .corners = malloc(mesh->faces_size * 3 * sizeof(corner_t)),
+  };
+  while (set.capacity < 2 * (uint32_t) max(mesh->positions_size, max(mesh->texcoords_size, mesh->normals_size))) {
+    set.capacity *= 2;
+  }
+  set.slots = calloc(set.capacity, sizeof(uint32_t));
+
+  // Number each distinct corner the first time it shows up
+  geometry->triangles_size = mesh->faces_size;
+  geometry->indices = malloc(mesh->faces_size * 3 * sizeof(uint32_t));
+  for (int i = 0; i < mesh->faces_size; ++i) {
+    geometry->indices[i * 3] = corner_set_add(&set, mesh->faces[i].a);
+    geometry->indices[i * 3 + 1] = corner_set_add(&set, mesh->faces[i].b);
+    geometry->indices[i * 3 + 2] = corner_set_add(&set, mesh->faces[i].c);
+  }
+
+  // Then gather the attributes for each one
+  geometry->vertices_size = set.corners_size;
+  geometry->positions = positions_alloc(set.corners_size);
+  geometry->vertices = malloc(set.corners_size * sizeof(vertex_t));
+  for (int i = 0; i < set.corners_size; ++i) {
+    vec3_t position = mesh->positions[set.corners[i].position];
+    geometry->positions.x[i] = position.x;
+    geometry->positions.y[i] = position.y;
+    geometry->positions.z[i] = position.z;
+    geometry->vertices[i] = (vertex_t) {
+      .texcoord = mesh->texcoords[set.corners[i].texcoord],
+      .normal = mesh->normals[set.corners[i].normal],
     };
+  }
+
+  free(set.slots);
+  free(set.corners);
+}
 
-     // Draw the transformed triangle to the output image
-     // The great thing about triangles is that they stay triangles even after a mathematical shakedown
-     triangle(o_color, o_depth, p1_screen, tc1, n1, p2_screen, tc2, n2, p3_screen, tc3, n3, &texture);
+/** A 4x4 matrix, stored by rows. */
+typedef struct {
+  float m[4][4];
+} mat4_t;
+
+/** The identity matrix. */
+static mat4_t mat4_identity(void) {
+  return (mat4_t) {{
+    {1, 0, 0, 0},
+    {0, 1, 0, 0},
+    {0, 0, 1, 0},
+    {0, 0, 0, 1},
+  }};
+}
+
+/** Multiply two 4x4 matrices. */
+static mat4_t mat4_multiply(mat4_t a, mat4_t b) {
+  mat4_t result;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+    }
   }
+  return result;
+}
 
-  // Clean up head texture
-  free(texture.pixels);
+/** Map normalized device coordinates onto a screen, with Y pointing down and depths from zero to some maximum. */
+static mat4_t mat4_viewport(float width, float height, float depth) {
+  return (mat4_t) {{
+    {width * 0.5f, 0, 0, width * 0.5f},
+    {0, -height * 0.5f, 0, height * 0.5f},
+    {0, 0, depth * 0.5f, depth * 0.5f},
+    {0, 0, 0, 1},
+  }};
+}
 
-  // Clean up model data
-  free(faces);
-  free(texcoords);
-  free(positions);
+/** Transform positions [begin, end) by a matrix, then divide through by W. */
+static void positions_transform_scalar(positions_t out, positions_t in, int begin, int end, const mat4_t* matrix) {
+  const float (*m)[4] = matrix->m;
+  for (int i = begin; i < end; ++i) {
+    float x = in.x[i];
+    float y = in.y[i];
+    float z = in.z[i];
+    float w = m[3][0] * x + m[3][1] * y + m[3][2] * z + m[3][3];
+    out.x[i] = (m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3]) / w;
+    out.y[i] = (m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3]) / w;
+    out.z[i] = (m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3]) / w;
+  }
 }
 
-int main(void) {
-  // Allocate color buffer
-  image_t o_color;
-  o_color.width = 512;
-  o_color.height = 512;
-  o_color.pixels = malloc(o_color.width * o_color.height * sizeof(color_t));
+#ifdef HAVE_SSE2
+/** Transform positions four at a time using SSE2. Works like positions_transform_scalar(). */
+static void positions_transform_sse2(positions_t out, positions_t in, int begin, int end, const mat4_t* matrix) {
+  // Broadcast each matrix element across a register
+  __m128 m[4][4];
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      m[i][j] = _mm_set1_ps(matrix->m[i][j]);
+    }
+  }
 
-  // Allocate depth buffer
-  image_t o_depth;
-  o_depth.width = o_color.width;
-  o_depth.height = o_color.height;
-  o_depth.pixels = malloc(o_depth.width * o_depth.height * sizeof(color_t));
-
-  // Clear color buffer
-  for (int x = 0; x < o_color.width; ++x) {
-    for (int y = 0; y < o_color.height; ++y) {
-      image_pixel(&o_color, x, y) = (color_t) {
-        .r = 80,
-        .g = 80,
-        .b = 140,
-        .a = 255
+  int i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 x = _mm_loadu_ps(in.x + i);
+    __m128 y = _mm_loadu_ps(in.y + i);
+    __m128 z = _mm_loadu_ps(in.z + i);
+    __m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[3][0], x), _mm_mul_ps(m[3][1], y)), _mm_mul_ps(m[3][2], z)), m[3][3]);
+    _mm_storeu_ps(out.x + i, _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], x), _mm_mul_ps(m[0][1], y)), _mm_mul_ps(m[0][2], z)), m[0][3]), w));
+    _mm_storeu_ps(out.y + i, _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1][0], x), _mm_mul_ps(m[1][1], y)), _mm_mul_ps(m[1][2], z)), m[1][3]), w));
+    _mm_storeu_ps(out.z + i, _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2][0], x), _mm_mul_ps(m[2][1], y)), _mm_mul_ps(m[2][2], z)), m[2][3]), w));
+  }
+
+  // Leftovers
+  positions_transform_scalar(out, in, i, end, matrix);
+}
+#endif
+
+#ifdef HAVE_AVX2
+/** Transform positions eight at a time using AVX2. Works like positions_transform_scalar(). */
+__attribute__((target("avx2")))
+static void positions_transform_avx2(positions_t out, positions_t in, int begin, int end, const mat4_t* matrix) {
+  // Broadcast each matrix element across a register
+  __m256 m[4][4];
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      m[i][j] = _mm256_set1_ps(matrix->m[i][j]);
+    }
+  }
+
+  int i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 x = _mm256_loadu_ps(in.x + i);
+    __m256 y = _mm256_loadu_ps(in.y + i);
+    __m256 z = _mm256_loadu_ps(in.z + i);
+    __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[3][0], x), _mm256_mul_ps(m[3][1], y)), _mm256_mul_ps(m[3][2], z)), m[3][3]);
+    _mm256_storeu_ps(out.x + i, _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0][0], x), _mm256_mul_ps(m[0][1], y)), _mm256_mul_ps(m[0][2], z)), m[0][3]), w));
+    _mm256_storeu_ps(out.y + i, _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[1][0], x), _mm256_mul_ps(m[1][1], y)), _mm256_mul_ps(m[1][2], z)), m[1][3]), w));
+    _mm256_storeu_ps(out.z + i, _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[2][0], x), _mm256_mul_ps(m[2][1], y)), _mm256_mul_ps(m[2][2], z)), m[2][3]), w));
+  }
+
+  // Leftovers
+  positions_transform_scalar(out, in, i, end, matrix);
+}
+#endif
+
+/** The vertex transform in use. This is picked at startup like the span shader. */
+static void (*positions_transform_batch)(positions_t out, positions_t in, int begin, int end, const mat4_t* matrix) = positions_transform_scalar;
+
+/** The least number of vertices worth handing to a thread of its own. */
+#define TRANSFORM_CHUNK_SIZE 65536
+
+/** Everything the workers need to transform a batch of positions. */
+typedef struct {
+  positions_t out;
+  positions_t in;
+  int size;
+  int chunks;
+  const mat4_t* matrix;
+} transform_job_t;
+
+/** Transform one chunk of positions. */
+static void positions_transform_worker(void* arg, int index) {
+  transform_job_t* job = arg;
+
+  // Cut on multiples of eight so that only the last chunk has leftovers
+  int begin = (int) ((int64_t) job->size * index / job->chunks) & ~7;
+  int end = index + 1 == job->chunks ? job->size : (int) ((int64_t) job->size * (index + 1) / job->chunks) & ~7;
+  positions_transform_batch(job->out, job->in, begin, end, job->matrix);
+}
+
+/** Transform a whole stream of positions by a matrix, then divide through by W. */
+static void positions_transform(positions_t out, positions_t in, int size, const mat4_t* matrix) {
+  transform_job_t job = {
+    .out = out,
+    .in = in,
+    .size = size,
+    .chunks = min(thread_count(), size / TRANSFORM_CHUNK_SIZE + 1),
+    .matrix = matrix,
+  };
+  parallel_run(job.chunks, positions_transform_worker, &job);
+}
+
+/** Everything the workers need to shade a frame from its visibility buffer. */
+typedef struct {
+  image_t* o_color;
+  const visibility_buffer_t* visibility;
+  const geometry_t* geometry;
+  const texture_t* texture;
+  const float* lods;
+  int bands;
+} resolve_job_t;
+
+/** Shade one band of rows from the visibility buffer. */
+static void resolve_worker(void* arg, int index) {
+  resolve_job_t* job = arg;
+  const geometry_t* geometry = job->geometry;
+  const texture_t* texture = job->texture;
+
+  int y1 = job->o_color->height * index / job->bands;
+  int y2 = job->o_color->height * (index + 1) / job->bands;
+  for (int y = y1; y < y2; ++y) {
+    for (int x = 0; x < job->o_color->width; ++x) {
+      const visibility_t* sample = &visibility_sample(job->visibility, x, y);
+      if (sample->triangle == VISIBILITY_NONE) {
+        continue;
+      }
+
+      // Blend the attributes of the triangle's corners
+      const vertex_t* a = &geometry->vertices[geometry->indices[sample->triangle * 3]];
+      const vertex_t* b = &geometry->vertices[geometry->indices[sample->triangle * 3 + 1]];
+      const vertex_t* c = &geometry->vertices[geometry->indices[sample->triangle * 3 + 2]];
+      float u = 1.0f - sample->v - sample->w;
+      vec2_t texcoord = {
+        .x = u * a->texcoord.x + sample->v * b->texcoord.x + sample->w * c->texcoord.x,
+        .y = u * a->texcoord.y + sample->v * b->texcoord.y + sample->w * c->texcoord.y,
+      };
+      vec3_t normal = {
+        .x = u * a->normal.x + sample->v * b->normal.x + sample->w * c->normal.x,
+        .y = u * a->normal.y + sample->v * b->normal.y + sample->w * c->normal.y,
+        .z = u * a->normal.z + sample->v * b->normal.z + sample->w * c->normal.z,
       };
+
+      // Look up the texture color, from the mip level picked when the triangle was set up
+      // Blending the corners rounds differently than stepping planes did, so keep to the texture's edges
+      color_t color;
+      if (options.mipmaps) {
+        color = texture_sample(texture, texcoord.x, texcoord.y, job->lods[sample->triangle]);
+      } else {
+        const image_t* level = &texture->level[0];
+        int tx = min(max((int) (texcoord.x * (float) level->width), 0), level->width - 1);
+        int ty = min(max((int) (texcoord.y * (float) level->height), 0), level->height - 1);
+        color = image_texel(level, tx, ty);
+      }
+
+      // Light the fragment with a forward lamp
+      // It passed for lit when it was drawn, but the blend can land a hair under zero
+      float lighting = max(0.0f, dot3(normal, (vec3_t) {.x = 0, .y = 0, .z = 1}));
+      color.r *= lighting;
+      color.g *= lighting;
+      color.b *= lighting;
+
+      // Drawing the triangle here already carried out any pending clear
+      image_pixel_swizzled(job->o_color, x, y) = color;
+    }
+  }
+}
+
+/** Shade every pixel that has a triangle in the visibility buffer, sampling each triangle's texture at its level in lods. The rows are split between the threads. */
+static void resolve(image_t* o_color, const visibility_buffer_t* visibility, const geometry_t* geometry, const texture_t* texture, const float* lods) {
+  resolve_job_t job = {
+    .o_color = o_color,
+    .visibility = visibility,
+    .geometry = geometry,
+    .texture = texture,
+    .lods = lods,
+    .bands = min(thread_count(), o_color->height),
+  };
+  parallel_run(job.bands, resolve_worker, &job);
+}
+
+/** Pick the SIMD kernels. Returns nonzero if the requested instruction set is not available. */
+static int select_kernels(void) {
+  int sse2 = 0;
+  int avx2 = 0;
+#ifdef HAVE_SSE2
+  sse2 = 1;
+#endif
+#ifdef HAVE_AVX2
+  avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  // Settle on an instruction set
+  simd_mode_t simd = options.simd;
+  if (simd == SIMD_AUTO) {
+    simd = avx2 ? SIMD_AVX2 : sse2 ? SIMD_SSE2 : SIMD_SCALAR;
+  }
+
+  switch (simd) {
+    case SIMD_AUTO:
+    case SIMD_SCALAR:
+      triangle_span = triangle_span_scalar;
+      positions_transform_batch = positions_transform_scalar;
+      return 0;
+    case SIMD_SSE2:
+#ifdef HAVE_SSE2
+      triangle_span = triangle_span_sse2;
+      positions_transform_batch = positions_transform_sse2;
+      return 0;
+#endif
+      break;
+    case SIMD_AVX2:
+#ifdef HAVE_AVX2
+      if (avx2) {
+        triangle_span = triangle_span_avx2;
+        positions_transform_batch = positions_transform_avx2;
+        return 0;
+      }
+#endif
+      break;
+  }
+  return -1;
+}
+
+/** Map a float to an unsigned key that sorts in the same order. */
+static uint32_t float_key(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  // Flip all bits of negative numbers to reverse their order, and just the sign bit of the rest to put them above
+  return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+/** Sort set-up triangles front to back by their nearest point. Returns the sorted array and frees the original. */
+static setup_t* triangles_sort(setup_t* setups, int size) {
+  // Larger depths are nearer, so flip the keys to sort the nearest first
+  uint32_t* keys = malloc(size * sizeof(uint32_t));
+  uint32_t* order = malloc(size * sizeof(uint32_t));
+  for (int i = 0; i < size; ++i) {
+    keys[i] = ~float_key(setups[i].z_max);
+    order[i] = (uint32_t) i;
+  }
+  radix_sort(keys, order, size);
+
+  setup_t* sorted = malloc(size * sizeof(setup_t));
+  for (int i = 0; i < size; ++i) {
+    sorted[i] = setups[order[i]];
+  }
+
+  free(order);
+  free(keys);
+  free(setups);
+  return sorted;
+}
+
+/** What gets drawn: the head model and its texture. It is loaded once and drawn every frame. */
+typedef struct {
+  geometry_t geometry;
+  texture_t texture;
+} scene_t;
+
+/** Load the head model and its texture. */
+static int scene_load(scene_t* scene) {
+  // Load the head model
+  mesh_t mesh;
+  if (mesh_load(&mesh, "data/african_head.obj")) {
+    fprintf(stderr, "error: failed to read model file\n");
+    return -1;
+  }
+
+  // Weld it into one vertex per distinct corner
+  geometry_weld(&scene->geometry, &mesh);
+  mesh_free(&mesh);
+
+  // Load the head texture
+  if (texture_read(&scene->texture, "data/african_head_diffuse.tga")) {
+    fprintf(stderr, "error: failed to read texture file\n");
+    geometry_free(&scene->geometry);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Free the model and texture of a scene. */
+static void scene_free(scene_t* scene) {
+  texture_free(&scene->texture);
+  geometry_free(&scene->geometry);
+}
+
+/** Draw the head model. Where rows of tiles are final as soon as they are drawn, they are sent off to the output stream right away. */
+static void draw(image_t* o_color, depth_buffer_t* o_depth, image_stream_t* o_stream, const scene_t* scene) {
+  const geometry_t* geometry = &scene->geometry;
+  const texture_t* texture = &scene->texture;
+
+  // The camera looks straight down the Z-axis at the model with no perspective
+  // This is naive just like in lesson 1 (we just drop the Z-axis altogether!)
+  mat4_t model_view_projection = mat4_identity();
+
+  // Transform vertices into our screen space
+  mat4_t transform = mat4_multiply(mat4_viewport((float) o_color->width, (float) o_color->height, depth_max(o_depth->format)), model_view_projection);
+  positions_t screen = positions_alloc(geometry->vertices_size);
+  positions_transform(screen, geometry->positions, geometry->vertices_size, &transform);
+
+  // Set up triangles, counting what happens to them
+  // The resolve pass finds mip levels by triangle, as it has no setups to look in
+  int setups_size = 0;
+  setup_t* setups = malloc(geometry->triangles_size * sizeof(setup_t));
+  float* lods = malloc(geometry->triangles_size * sizeof(float));
+  int setup_counts[6] = {0};
+
+  // Iterate over triangles in model
+  for (int i = 0; i < geometry->triangles_size; ++i) {
+    uint32_t i1 = geometry->indices[i * 3];
+    uint32_t i2 = geometry->indices[i * 3 + 1];
+    uint32_t i3 = geometry->indices[i * 3 + 2];
+    const vertex_t* v1 = &geometry->vertices[i1];
+    const vertex_t* v2 = &geometry->vertices[i2];
+    const vertex_t* v3 = &geometry->vertices[i3];
+
+    // Set up the transformed triangle for drawing
+    // The great thing about triangles is that they stay triangles even after a mathematical shakedown
+    vec3_t p1 = {screen.x[i1], screen.y[i1], screen.z[i1]};
+    vec3_t p2 = {screen.x[i2], screen.y[i2], screen.z[i2]};
+    vec3_t p3 = {screen.x[i3], screen.y[i3], screen.z[i3]};
+    setup_result_t result = triangle_setup(&setups[setups_size], o_color, p1, v1->texcoord, v1->normal, p2, v2->texcoord, v2->normal, p3, v3->texcoord, v3->normal);
+    setup_counts[result]++;
+    if (result == SETUP_DRAWN) {
+      // Texture coordinates are interpolated straight across the screen, so their rate of change is the same everywhere on the triangle
+      setup_t* s = &setups[setups_size++];
+      s->triangle = i;
+      s->lod = texture_lod(texture, s->tx.dx, s->ty.dx, s->tx.dy, s->ty.dy);
+      lods[i] = s->lod;
+    }
+  }
+
+  // Put the nearest triangles first, so that they fill in the depth buffer before what they hide gets drawn
+  if (options.sort) {
+    setups = triangles_sort(setups, setups_size);
+  }
+
+  if (options.stats) {
+    fprintf(stderr, "setup: %d triangles, %d back-facing, %d degenerate, %d off-screen, %d past guard band, %d empty, %d drawn\n",
+        geometry->triangles_size,
+        setup_counts[SETUP_BACK_FACING],
+        setup_counts[SETUP_DEGENERATE],
+        setup_counts[SETUP_OFF_SCREEN],
+        setup_counts[SETUP_GUARD_BAND],
+        setup_counts[SETUP_EMPTY],
+        setup_counts[SETUP_DRAWN]);
+  }
+
+  // The visibility buffer starts out with nothing drawn anywhere
+  visibility_buffer_t visibility = {
+    .width = o_color->width,
+    .height = o_color->height,
+  };
+  if (options.shading == SHADING_VISIBILITY) {
+    size_t size = swizzle_size(visibility.width, visibility.height);
+    visibility.samples = malloc(size * sizeof(visibility_t));
+    for (size_t i = 0; i < size; ++i) {
+      visibility.samples[i].triangle = VISIBILITY_NONE;
     }
   }
 
-  // Clear depth buffer
-  for (int x = 0; x < o_depth.width; ++x) {
-    for (int y = 0; y < o_depth.height; ++y) {
-      image_pixel(&o_depth, x, y).value = INT32_MIN;
+  // Draw the triangles to the output image
+  if (options.raster == RASTER_TILED) {
+    // Tiles are only final as they finish if nothing is left to shade afterward
+    image_stream_t* stream = options.shading == SHADING_VISIBILITY ? NULL : o_stream;
+    triangles_tiled(o_color, o_depth, &visibility, stream, setups, setups_size, texture);
+  } else if (options.shading == SHADING_DEFERRED) {
+    for (int i = 0; i < setups_size; ++i) {
+      triangle(o_color, o_depth, NULL, &setups[i], texture, PASS_DEPTH);
+    }
+    for (int i = 0; i < setups_size; ++i) {
+      triangle(o_color, o_depth, NULL, &setups[i], texture, PASS_SHADE);
+    }
+  } else {
+    pass_t pass = options.shading == SHADING_VISIBILITY ? PASS_VISIBILITY : PASS_FORWARD;
+    for (int i = 0; i < setups_size; ++i) {
+      triangle(o_color, o_depth, &visibility, &setups[i], texture, pass);
     }
   }
 
-  // Draw the model
-  draw(&o_color, &o_depth);
+  // Then shade what ended up visible
+  if (options.shading == SHADING_VISIBILITY) {
+    resolve(o_color, &visibility, geometry, texture, lods);
+  }
+
+  // Clean up visibility buffer
+  free(visibility.samples);
+
+  // Clean up triangles
+  free(lods);
+  free(setups);
+  positions_free(&screen);
+}
+
+int main(int argc, char* argv[]) {
+  // Read options
+  if (parse_options(argc, argv)) {
+    fprintf(stderr, "usage: %s [--raster=scan|tiled] [--threads=N] [--simd=auto|scalar|sse2|avx2] [--cache=on|off] [--cull=back|none] [--hiz=on|off] [--sort=front|none] [--mipmaps=on|off] [--texture-layout=linear|blocked|morton] [--shading=forward|deferred|visibility] [--depth=d16|d24|d32f] [--output=png|raw|ppm|qoi] [--frames=N] [--png-level=0-9] [--png-threads=N] [--stats]\n", argv[0]);
+    return 1;
+  }
+
+  // Pick the SIMD kernels
+  if (select_kernels()) {
+    fprintf(stderr, "error: instruction set not supported\n");
+    return 1;
+  }
+
+  // Load what we draw, which stays the same from frame to frame
+  scene_t scene;
+  if (scene_load(&scene)) {
+    return 1;
+  }
+
+  // Allocate color buffers, all of them free to draw into
+  image_t o_colors[OUTPUT_BUFFERS];
+  image_stream_t o_streams[OUTPUT_BUFFERS];
+  frame_queue_t free_frames;
+  frame_queue_init(&free_frames);
+  for (int i = 0; i < OUTPUT_BUFFERS; ++i) {
+    image_alloc(&o_colors[i], 512, 512, IMAGE_SWIZZLED);
+    frame_queue_push(&free_frames, (frame_t) {.image = &o_colors[i], .stream = &o_streams[i]});
+  }
+
+  // Allocate depth buffer
+  // Depth is not written out, so one is enough
+  depth_buffer_t o_depth;
+  depth_buffer_alloc(&o_depth, o_colors[0].width, o_colors[0].height, options.depth);
+  if (options.shading == SHADING_DEFERRED) {
+    o_depth.owners = malloc(swizzle_size(o_depth.width, o_depth.height) * sizeof(uint32_t));
+  }
+
+  // Start the writer, which saves each frame while the next one is drawn
+  frame_queue_t finished_frames;
+  frame_queue_init(&finished_frames);
+  writer_t writer = {
+    .finished = &finished_frames,
+    .free = &free_frames,
+  };
+  pthread_t writer_handle;
+  if (pthread_create(&writer_handle, NULL, writer_thread, &writer)) {
+    fprintf(stderr, "error: failed to start thread\n");
+    return 1;
+  }
+
+  for (int i = 0; i < options.frames; ++i) {
+    // Wait for a color buffer, which holds us back if the writer falls behind
+    frame_t frame;
+    frame_queue_pop(&free_frames, &frame);
+
+    // Clear color buffer
+    image_clear(frame.image, (color_t) {
+      .r = 80,
+      .g = 80,
+      .b = 140,
+      .a = 255
+    });
 
-  // Try to save the color buffer
-  if (image_write_png(&o_color, "output3.png")) {
-    fprintf(stderr, "error: failed to save color buffer\n");
+    // Clear depth buffer
+    depth_buffer_clear(&o_depth);
+
+    // Start writing it out, so the tiled rasterizer can send off each row of tiles as it finishes
+    // A single frame keeps the plain name, while a sequence numbers them
+    char name[64];
+    if (options.frames == 1) {
+      snprintf(name, sizeof(name), "output3");
+    } else {
+      snprintf(name, sizeof(name), "output3_%04d", i);
+    }
+    if (image_stream_open(frame.stream, frame.image, name, options.output, TILE_SIZE)) {
+      fprintf(stderr, "error: failed to save frame %d\n", i);
+      return 1;
+    }
+
+    // Draw the model
+    draw(frame.image, &o_depth, frame.stream, &scene);
+
+    // Hand it to the writer
+    frame.number = i;
+    frame_queue_push(&finished_frames, frame);
+  }
+
+  // Wait for the writer to save the last of them
+  frame_queue_close(&finished_frames);
+  pthread_join(writer_handle, NULL);
+  if (writer.error) {
     return 1;
   }
 
   // Clean up output
-  free(o_depth.pixels);
-  free(o_color.pixels);
+  frame_queue_destroy(&finished_frames);
+  frame_queue_destroy(&free_frames);
+  free(o_depth.owners);
+  free(o_depth.pending);
+  free(o_depth.data);
+  for (int i = 0; i < OUTPUT_BUFFERS; ++i) {
+    free(o_colors[i].pending);
+    free(o_colors[i].pixels);
+  }
+  // Clean up scene
+  scene_free(&scene);
 }
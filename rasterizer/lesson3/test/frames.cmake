@@ -0,0 +1,48 @@
+#
+# Renderer Experiments
+# Copyright (c) 2019 Tyler Filla
+#
+# This work is released under the WTFPL. See the LICENSE file for details.
+#
+
+# Render a sequence of frames and check that every one of them matches the first.
+# The scene does not move, so any difference between frames is a bug.
+#
+# Expects RASTERIZER (the executable), DATA (the data directory), WORK (a
+# scratch directory), FRAMES (how many to render) and ARGS (any further
+# options, separated by semicolons).
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(COPY ${DATA}/african_head.obj ${DATA}/african_head_diffuse.tga DESTINATION ${WORK}/data)
+
+execute_process(
+        COMMAND ${RASTERIZER} --frames=${FRAMES} --output=raw --cache=off ${ARGS}
+        WORKING_DIRECTORY ${WORK}
+        RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "rasterizer failed: ${result}")
+endif()
+
+# Frames are numbered with four digits
+function(frame_name index out)
+    string(LENGTH "${index}" length)
+    set(name "${index}")
+    while(length LESS 4)
+        set(name "0${name}")
+        math(EXPR length "${length} + 1")
+    endwhile()
+    set(${out} "${WORK}/output3_${name}.raw" PARENT_SCOPE)
+endfunction()
+
+frame_name(0 first)
+math(EXPR last "${FRAMES} - 1")
+foreach(index RANGE 1 ${last})
+    frame_name(${index} frame)
+    execute_process(
+            COMMAND ${CMAKE_COMMAND} -E compare_files ${first} ${frame}
+            RESULT_VARIABLE different)
+    if(different)
+        message(FATAL_ERROR "frame ${index} differs from frame 0")
+    endif()
+endforeach()
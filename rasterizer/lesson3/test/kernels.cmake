@@ -0,0 +1,51 @@
+#
+# Renderer Experiments
+# Copyright (c) 2019 Tyler Filla
+#
+# This work is released under the WTFPL. See the LICENSE file for details.
+#
+
+# Render the same frame with every span kernel under both rasterizers and
+# check that they all match. Each kernel works out a pixel's attributes the
+# same way, so any difference between them is a bug.
+#
+# Expects RASTERIZER (the executable), DATA (the data directory), WORK (a
+# scratch directory) and ARGS (any further options, separated by semicolons).
+# A kernel the processor cannot run is skipped.
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+file(COPY ${DATA}/african_head.obj ${DATA}/african_head_diffuse.tga DESTINATION ${WORK}/data)
+
+set(first "")
+foreach(simd scalar sse2 avx2)
+    foreach(raster scan tiled)
+        execute_process(
+                COMMAND ${RASTERIZER} --frames=1 --output=raw --cache=off --simd=${simd} --raster=${raster} ${ARGS}
+                WORKING_DIRECTORY ${WORK}
+                RESULT_VARIABLE result
+                ERROR_VARIABLE error)
+        if(NOT result EQUAL 0)
+            if(error MATCHES "instruction set not supported")
+                message(STATUS "skipping ${simd}: not supported here")
+                continue()
+            endif()
+            message(FATAL_ERROR "rasterizer failed with ${simd} and ${raster}: ${result}\n${error}")
+        endif()
+
+        # Keep each output, and compare it to the first one rendered
+        set(output "${WORK}/output3_${simd}_${raster}.raw")
+        file(RENAME ${WORK}/output3.raw ${output})
+        if(first STREQUAL "")
+            set(first ${output})
+            set(first_name "${simd} and ${raster}")
+            continue()
+        endif()
+        execute_process(
+                COMMAND ${CMAKE_COMMAND} -E compare_files ${first} ${output}
+                RESULT_VARIABLE different)
+        if(different)
+            message(FATAL_ERROR "${simd} and ${raster} differs from ${first_name}")
+        endif()
+    endforeach()
+endforeach()